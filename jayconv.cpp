@@ -0,0 +1,361 @@
+/*****************************************************************************
+ *
+ * jayconv - converts recordings between the text format and the binary
+ * format of jayrecord.h, whichever way the input isn't.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ ****************************************************************************/
+
+/*****************************************************************************
+ * Includes
+ ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "jayrecord.h"
+
+#define PROG "jayconv"
+
+/*****************************************************************************
+ * Globals...
+ ****************************************************************************/
+char * InName = NULL;
+char * OutName = NULL;
+
+// a binary recording gets a checkpoint every CheckpointInterval ms of its
+// time, like the ones jayrec writes
+unsigned int CheckpointInterval = 10000;
+
+/****************************************************************************/
+/*! Prints the usage, i.e. how the program is used. Exits the application with
+    the passed exit-code.
+
+	\arg const int ExitCode - the exitcode to use for exiting.
+*/
+/****************************************************************************/
+void usage (const int exitCode) {
+
+  // print the usage
+  std::cerr << PROG << " " << VERSION << std::endl;
+  std::cerr << "Usage: " << PROG << " [options] [input [output]]" << std::endl;
+  std::cerr << "A text recording is converted to a binary one and the other way" << std::endl
+	   << "around. Without input and output, or with -, stdin and stdout are used." << std::endl;
+  std::cerr << "Options: " << std::endl;
+  std::cerr << "  -c  SECONDS time between checkpoints of a binary recording." << std::endl
+	   << "              Default: 10." << std::endl
+	   << "  -v          show version. " << std::endl
+	   << "  -h          this help. " << std::endl << std::endl;
+
+  // we're done
+  exit ( exitCode );
+}
+
+
+/****************************************************************************/
+/*! Prints the version of the application and exits.
+*/
+/****************************************************************************/
+void version () {
+
+  // print the version
+  std::cerr << PROG << " " << VERSION << std::endl;
+
+  // we're done
+  exit ( EXIT_SUCCESS );
+}
+
+
+/****************************************************************************/
+/*! Parses the commandline and stores all data in globals.
+
+	\arg int argc - number of commandline arguments.
+	\arg char * argv[] - vector of the commandline argument strings.
+*/
+/****************************************************************************/
+void parseCommandLine (int argc, char * argv[]) {
+
+  int Index = 1;
+
+  while ( Index < argc ) {
+
+	if ( strcmp (argv[Index], "-v" ) == 0 ) {
+	  version ();
+	}
+
+	else if ( strcmp (argv[Index], "-h" ) == 0 ) {
+	  usage ( EXIT_SUCCESS );
+	}
+
+	// is this '-c'?
+	else if ( strcmp (argv[Index], "-c" ) == 0 && Index + 1 < argc ) {
+	  if ( sscanf ( argv[Index + 1], "%u", &CheckpointInterval ) != 1 || CheckpointInterval == 0 ) {
+		std::cerr << "Invalid parameter for '-c'." << std::endl;
+		usage ( EXIT_FAILURE );
+	  }
+	  CheckpointInterval *= 1000;
+	  Index++;
+	}
+
+	else if ( InName == NULL ) {
+	  InName = argv [ Index ];
+	}
+
+	else if ( OutName == NULL ) {
+	  OutName = argv [ Index ];
+	}
+
+	else {
+	  std::cerr << "Invalid parameter '" << argv[Index] << "'." << std::endl;
+	  usage ( EXIT_FAILURE );
+	}
+
+	Index++;
+  }
+}
+
+
+/****************************************************************************/
+/*! Writes a binary recording as the lines jayrec -t writes, the time before
+    an event becomes a Delay line. The text format has no checkpoints, so
+    those are lost.
+*/
+/****************************************************************************/
+int toText (const std::string &in, std::ostream &out) {
+
+  RecordReader reader;
+  RecordEvent ev;
+  const char * p = in.data() + JAYREC_HEADER;
+  const char * end = in.data() + in.size();
+  unsigned long pause = 0;
+  bool paced = false;
+  int r;
+
+  while ( ( r = reader.Next ( p, end, ev ) ) > 0 ) {
+	// a checkpoint passes the time since the event before it on
+	pause += ev.time;
+	if ( ev.type != REC_TEXT && ev.type != REC_CHECKPOINT && pause > 0 ) {
+	  if ( ! paced ) {
+		// like in jayplay, the recorded pauses replace the delays
+		out << "SetMouseDelay 0" << std::endl
+			<< "SetKeyPressDelay 0" << std::endl
+			<< "SetDelay 0" << std::endl;
+		paced = true;
+	  }
+	  out << "Delay " << pause << "ms" << std::endl;
+	  pause = 0;
+	}
+	switch ( ev.type ) {
+	  case REC_MOTION:
+		out << "MotionNotify " << ev.x << " " << ev.y << std::endl;
+		break;
+	  case REC_BUTTONPRESS:
+		out << "ButtonPress " << ev.b << std::endl;
+		break;
+	  case REC_BUTTONRELEASE:
+		out << "ButtonRelease " << ev.b << std::endl;
+		break;
+	  case REC_KEYPRESS:
+		out << "KeyStrPress " << ev.text << std::endl;
+		break;
+	  case REC_KEYRELEASE:
+		out << "KeyStrRelease " << ev.text << std::endl;
+		break;
+	  case REC_CHECKPOINT:
+		// text recordings are always played from the start
+		break;
+	  default:
+		out.write ( ev.text, ev.length );
+		out << std::endl;
+		paced = paced || std::string ( ev.text, ev.length ) == "SetDelay 0";
+		break;
+	}
+  }
+
+  if ( r < 0 || p != end ) {
+	std::cerr << PROG << ": recording is damaged at byte " << p - in.data() << std::endl;
+	return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+
+/****************************************************************************/
+/*! Writes a text recording as a binary one. The events jayrec writes become
+    event records, any other line is kept as a text record. The Delay Nms
+    lines of jayrec -t become the time of the event after them. Like jayrec
+    does, a checkpoint goes before the first event and then before the first
+    one CheckpointInterval ms after the last checkpoint, and the index of them
+    goes at the end, so --start-at works on the result.
+*/
+/****************************************************************************/
+int toBinary (const std::string &in, std::ostream &out) {
+
+  RecordWriter writer;
+  std::string data;
+  std::string line, ev, arg;
+  std::istringstream lines ( in );
+  int x, y;
+  unsigned int b;
+  unsigned long pause = 0, ms;
+  char c;
+  // what the checkpoints need, the state before the next event
+  std::vector<RecordIndexEntry> index;
+  RecordCheckpoint state;
+  unsigned long long written = 0;
+  unsigned long clock = 0, last = 0;
+  state.events = 0;
+  state.x = state.y = 0;
+  state.status1 = state.status2 = 0;
+  state.buttons = 0;
+
+  writer.Header ( data );
+  while ( std::getline ( lines, line ) ) {
+	size_t first = line.find_first_not_of ( " \t\r" );
+	if ( first == std::string::npos ) {
+	  continue;
+	}
+	line = line.substr ( first, line.find_last_not_of ( " \t\r" ) - first + 1 );
+
+	std::istringstream tokens ( line );
+	std::string rest;
+	tokens >> ev;
+	if ( ev == "Delay" && sscanf ( line.c_str(), "Delay %lums%c", &ms, &c ) == 1 &&
+		 line.find ( "ms" ) == line.size() - 2 ) {
+	  pause += ms;
+	  continue;
+	}
+	clock += pause;
+	bool motion = ev == "MotionNotify" && tokens >> x >> y && ! ( tokens >> rest );
+	bool button = ! motion && ( ev == "ButtonPress" || ev == "ButtonRelease" ) &&
+				  tokens >> b && ! ( tokens >> rest );
+	bool key = ! motion && ! button && ( ev == "KeyStrPress" || ev == "KeyStrRelease" ) &&
+			   tokens >> arg && ! ( tokens >> rest );
+	if ( ( motion || button || key ) &&
+		 ( index.empty() || clock - last >= CheckpointInterval ) ) {
+	  // it goes before the event, with the time since the one before
+	  state.number = index.size();
+	  state.time = clock;
+	  RecordIndexEntry entry = { state.number, state.time, written + data.size() };
+	  index.push_back ( entry );
+	  writer.Checkpoint ( data, pause, state );
+	  last = clock;
+	  pause = 0;
+	}
+	if ( motion ) {
+	  writer.Motion ( data, pause, x, y );
+	  state.x = x;
+	  state.y = y;
+	} else if ( button ) {
+	  writer.Button ( data, pause, ev == "ButtonPress", b );
+	  if ( b < sizeof(state.buttons) * 8 ) {
+		if ( ev == "ButtonPress" ) state.buttons |= 1UL << b;
+		else state.buttons &= ~(1UL << b);
+	  }
+	} else if ( key ) {
+	  writer.Key ( data, pause, ev == "KeyStrPress", arg );
+	  std::vector<std::string>::iterator held = std::find ( state.keys.begin(), state.keys.end(), arg );
+	  if ( ev == "KeyStrPress" && held == state.keys.end() ) {
+		state.keys.push_back ( arg );
+	  } else if ( ev == "KeyStrRelease" && held != state.keys.end() ) {
+		state.keys.erase ( held );
+	  }
+	} else {
+	  if ( pause > 0 ) {
+		// only events have a time, the pause stays a line of its own
+		std::ostringstream delay;
+		delay << "Delay " << pause << "ms";
+		writer.Text ( data, 0, delay.str() );
+	  }
+	  writer.Text ( data, 0, line );
+	}
+	if ( motion || button || key ) {
+	  state.events++;
+	}
+	pause = 0;
+	if ( data.size() > 65536 ) {
+	  out.write ( data.data(), data.size() );
+	  written += data.size();
+	  data.clear();
+	}
+  }
+  if ( pause > 0 ) {
+	std::ostringstream delay;
+	delay << "Delay " << pause << "ms";
+	writer.Text ( data, 0, delay.str() );
+  }
+  // the index of the checkpoints goes last
+  writer.Index ( data, index, written + data.size() );
+  out.write ( data.data(), data.size() );
+  return EXIT_SUCCESS;
+}
+
+
+/****************************************************************************/
+/*! Main function of the application.
+
+    \arg int argc - number of commandline arguments.
+	\arg char * argv[] - vector of the commandline argument strings.
+*/
+/****************************************************************************/
+int main (int argc, char * argv[]) {
+
+  std::string in;
+  std::ofstream file;
+  std::ostream * out = &std::cout;
+
+  parseCommandLine ( argc, argv );
+
+  // read all of the input
+  if ( InName == NULL || strcmp ( InName, "-" ) == 0 ) {
+	std::ostringstream all;
+	all << std::cin.rdbuf();
+	in = all.str();
+  } else {
+	std::ifstream input ( InName, std::ios::binary );
+	if ( ! input ) {
+	  std::cerr << PROG << ": could not open " << InName << std::endl;
+	  exit ( EXIT_FAILURE );
+	}
+	std::ostringstream all;
+	all << input.rdbuf();
+	in = all.str();
+  }
+
+  if ( OutName != NULL && strcmp ( OutName, "-" ) != 0 ) {
+	file.open ( OutName, std::ios::binary );
+	if ( ! file ) {
+	  std::cerr << PROG << ": could not write " << OutName << std::endl;
+	  exit ( EXIT_FAILURE );
+	}
+	out = &file;
+  }
+
+  int result;
+  if ( isRecording ( in.data(), in.size() ) ) {
+	result = toText ( in, *out );
+  } else {
+	result = toBinary ( in, *out );
+  }
+  out->flush();
+
+  exit ( result );
+}
@@ -39,13 +39,34 @@
 #include <math.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
 #include <X11/Xlibint.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/Xatom.h>
 #include <X11/cursorfont.h>
 #include <X11/keysymdef.h>
 #include <X11/keysym.h>
 #include <X11/extensions/XTest.h>
+#include <X11/XWDFile.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xdamage.h>
+#include <png.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 #include <iostream>
 #include <iomanip>
 #include <iostream>
@@ -57,14 +78,19 @@
 #include <functional> 
 #include <locale>
 #include <map>
+#include <list>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <boost/regex.hpp>
-#include <boost/config/warning_disable.hpp>
-#include <boost/spirit/include/qi.hpp>
-#include <boost/spirit/include/phoenix_core.hpp>
-#include <boost/spirit/include/phoenix_operator.hpp>
+#include <boost/utility/string_ref.hpp>
 using namespace __gnu_cxx;
 
 #include "chartbl.h"
+#include "jayrecord.h"
 /***************************************************************************** 
  * What iostream do we have?
  ****************************************************************************/
@@ -81,19 +107,109 @@ struct file_object {
   const char * name;
   int length;
 };
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * A register. Values are kept as an int, a double or a string and are only
+ * converted to text when something actually needs the text, so counters can
+ * be incremented without going through a string at all.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 class Variable {
   public:
-    Variable();
-    ~Variable();
-    void Set(std::string str) {
+    Variable() : p_type(_VSTRING), p_int(0), p_double(0), p_text_valid(true) {}
+    ~Variable() {}
+    void Set(const std::string &str) {
       p_data_as_string = str;
       p_type = _VSTRING;
+      p_text_valid = true;
+    }
+    void SetInt(long i) {
+      p_int = i;
+      p_type = _VINT;
+      p_text_valid = false;
     }
-    std::string ToString() {
+    void SetDouble(double d) {
+      p_double = d;
+      p_type = _VDOUBLE;
+      p_text_valid = false;
+    }
+    const std::string &ToString() {
+      if (!p_text_valid) {
+        char buf[32];
+        int len;
+        if (p_type == _VINT) {
+          len = snprintf(buf, sizeof(buf), "%ld", p_int);
+        } else {
+          // same as what a default std::ostream would print
+          len = snprintf(buf, sizeof(buf), "%g", p_double);
+        }
+        p_data_as_string.assign(buf, len);
+        p_text_valid = true;
+      }
       return p_data_as_string;
     }
+    long ToInt() {
+      if (p_type == _VSTRING && !parseNumber()) {
+        return (long)strtod(p_data_as_string.c_str(), NULL);
+      }
+      return p_type == _VINT ? p_int : (long)p_double;
+    }
+    double ToDouble() {
+      if (p_type == _VSTRING && !parseNumber()) {
+        return strtod(p_data_as_string.c_str(), NULL);
+      }
+      return p_type == _VINT ? (double)p_int : p_double;
+    }
+    // true if the value is a number, a string is checked for one
+    bool IsNumeric() {
+      return p_type != _VSTRING || parseNumber();
+    }
+    // used by set x++ and set x--
+    void Add(long delta) {
+      if (p_type == _VSTRING && !parseNumber()) {
+        // whatever number the text starts with, 0 if none
+        SetDouble(strtod(p_data_as_string.c_str(), NULL));
+        if (p_double == floor(p_double) && fabs(p_double) < 1e15) {
+          SetInt((long)p_double);
+        }
+      }
+      if (p_type == _VINT) {
+        p_int += delta;
+      } else {
+        p_double += delta;
+      }
+      p_text_valid = false;
+    }
+    int Type() {
+      return p_type;
+    }
   private:
+    // if the whole text is a number, keep it as one (the text stays as it
+    // was, so "05" still prints as 05)
+    bool parseNumber() {
+      const char * s = p_data_as_string.c_str();
+      char * end;
+      if (*s == 0) {
+        return false;
+      }
+      long i = strtol(s, &end, 10);
+      while (isspace(*end)) end++;
+      if (end != s && *end == 0) {
+        p_int = i;
+        p_type = _VINT;
+        return true;
+      }
+      double d = strtod(s, &end);
+      while (isspace(*end)) end++;
+      if (end != s && *end == 0) {
+        p_double = d;
+        p_type = _VDOUBLE;
+        return true;
+      }
+      return false;
+    }
     int p_type;
+    long p_int;
+    double p_double;
+    bool p_text_valid;
     std::string p_data_as_string;
 };
 /***************************************************************************** 
@@ -112,13 +228,79 @@ const float DefaultScale = 1.0;
  * Globals...
  ****************************************************************************/
 
-int _SourceLines = 150;
 int   Delay = DefaultDelay;
 float Scale = DefaultScale;
 char * Remote;
-int Entry = NULL;
-std::string * Source = new std::string[_SourceLines];
+int Entry = -1;        // the line main or entry is on, -1 until one is seen
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * The script is mapped into memory as is, Source only points at the lines
+ * in it (trimmed, blank lines and comments left out) so a recording of a
+ * few hundred MB isn't copied into strings first.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+struct ScriptMap {
+  const char * data;
+  size_t size;
+  bool mapped;          // else data points into buffer
+  std::string buffer;   // when the file can't be mapped, a pipe for instance
+};
+ScriptMap Script = { NULL, 0, false };
+std::vector<boost::string_ref> Source;
 int SourceNumLines = 0;
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * When Streaming (-S, or the script comes from stdin) the script is played
+ * as it is read and only StreamWindow decoded lines are kept, see streamLine.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+bool Streaming = false;
+int StreamWindow = 4096;
+int _StreamCheckpoint = 256;
+char * ScriptName = NULL;
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * --start-at plays a binary recording from the checkpoint with that number,
+ * or from the last one at or before that time (in ms). StartCheckpoint is
+ * the one that was found, what was held down then is pressed again first.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+bool StartAt = false;
+bool StartAtTime = false;
+unsigned long StartAtValue = 0;
+long StartCheckpoint = -1;
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * --speed divides every wait of the timeline, --idle (in ms) cuts the long
+ * ones short before that. Both apply to the pauses of a recording too.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+double Speed = 1.0;
+long long IdleLimit = -1;       // in ns, -1 leaves the waits alone
+bool RecordedTimes = false;     // a binary recording with times was read
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * -p (pixels) and -g (ms) simplify the runs of MotionNotify in a script or
+ * recording once it is loaded, see simplifyMotion.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+double PathTolerance = 0;
+unsigned long PathGap = 0;
+unsigned long MotionSeen = 0, MotionDropped = 0;
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * --frames keeps the last seconds of the screen in memory, see frameLoop.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+double FrameRate = 0;                   // frames a second, 0 when it's off
+long long FrameKeep = 10000000000LL;    // ns
+size_t FrameMemory = 64 << 20;          // bytes
+std::string FrameDir = "frames";
+const char * FramebufferName = NULL;    // --fb, the XWD file of Xvfb -fbdir
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Injected events wait in Xlib's output buffer until a flush, see
+ * flushEvents. -B and -L set how many, and for how long.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int FlushBatch = 256;
+int FlushLatency = 20;
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * With -c (or -C DIR) what a script decodes into is written to a compiled
+ * script, script.jayc next to it or DIR/HASH.jayc, and the next run loads
+ * that instead when the hash of the script still matches. Included scripts
+ * get one of their own.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+bool Compiled = false;
+char * CompiledDir = NULL;
+int CompiledLoaded = 0;
+int CompiledWritten = 0;
 std::map<std::string,int> Labels;
 int Index = 0;
 Display * GlobalDisplay;
@@ -127,1108 +309,5360 @@ int GlobalScreen;
  * Registers is where we hold all of our variables, you can put anything you 
  * like in there, any variable name, however, some registers are reserved
  *
- * All variables are saved as strings, and only converted to ints if necessary
+ * Each variable is a slot in Registers and keeps whatever type it was last
+ * given, it is only converted to a string when it has to be printed
  * 
- * CS is the current CallStackPtr, it is an int.
- *
  * SCS is where break sends you, it is the position in the main loop when you 
  * first called goto
  *
  *  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-std::map<std::string,std::string> Registers;
-std::map<std::string,Variable *> Variables; 
+std::vector<Variable> Registers;
+std::map<std::string,int> RegisterSlots;
+std::vector<int> CaptureSlots;
+int SCSSlot;
 std::map<std::string,file_object *> OpenFiles;
 
-int CallStackPtr = 0;
-int _StackDepth = 60480;
-int CallStack[6048];
-
-
-// we put the function sigs here so that they are accessible
-static inline void executeLine(std::string &sline);
-static inline void executeIf(std::string &sline);
-static inline bool expressionResult(std::string &ltoken, 
-                                    std::string &comp, 
-                                    std::string & rtoken);
-static inline void saveRegexResult(boost::cmatch &what);
-
-
-namespace Parser {
-  namespace qi = boost::spirit::qi;
-  namespace ascii = boost::spirit::ascii;
-  namespace phoenix = boost::phoenix;
-  using qi::double_;
-  using qi::_1;
-  using qi::phrase_parse;
-  using ascii::space;
-  using phoenix::ref;
-
-  template <typename Iterator>
-  bool result(Iterator first, Iterator last, double &n) {
-
-    bool r = qi::phrase_parse (
-          first,
-          last,
-          // Parser begins here
-          (
-             double_[ref(n) = _1] >> (*("+" >> double_[ref(n) += _1]) || *("-" >> double_[ref(n) -= _1]))
-          ),
-          // Parser ends here
-          space
-        );
-    if (first != last)
-      return false;
-    return true;
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Register names are turned into slots in Registers when the script is
+ * loaded, registerSlot creates the slot the first time a name is seen. At
+ * run time registers are only ever reached through their slot, a register
+ * that was never set is an empty Variable.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static int registerSlot(const std::string &name) {
+  std::map<std::string,int>::iterator it = RegisterSlots.find(name);
+  if (it != RegisterSlots.end()) {
+    return it->second;
   }
-
-}
-
-/****************************************************************************/
-/*! Prints the usage, i.e. how the program is used. Exits the application with
-    the passed exit-code.
-
-	\arg const int ExitCode - the exitcode to use for exiting.
-*/
-/****************************************************************************/
-void usage (const int exitCode) {
-
-  // print the usage
-  std::cerr << PROG << " " << VERSION << std::endl;
-  std::cerr << "Usage: " << PROG << " [options] remote_display" << std::endl;
-  std::cerr << "Options: " << std::endl;
-  std::cerr << "  -d  DELAY   delay in milliseconds for events sent to remote display." << std::endl
-	   << "              Default: 10ms."
-	   << std::endl
-	   << "  -s  FACTOR  scalefactor for coordinates. Default: 1.0." << std::endl
-	   << "  -v          show version. " << std::endl
-	   << "  -h          this help. " << std::endl << std::endl;
-
-  // we're done
-  exit ( EXIT_SUCCESS );
+  int slot = Registers.size();
+  Registers.push_back(Variable());
+  RegisterSlots[name] = slot;
+  return slot;
 }
 
-
-/****************************************************************************/
-/*! Prints the version of the application and exits.
-*/
-/****************************************************************************/
-void version () {
-
-  // print the version
-  std::cerr << PROG << " " << VERSION << std::endl;
- 
-  // we're done
-  exit ( EXIT_SUCCESS );
-}
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * The call stack. Every Goto or label call that is not a loop back-edge or a
+ * tail call pushes a Frame, Return pops it. The stack lives on the heap and
+ * grows as needed, _StackDepth is the hard limit on the number of frames.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+struct Frame {
+  int ret;    // line to continue at after Return
+  int entry;  // first line of the called label
+};
+std::vector<Frame> CallStack;
+int _StackDepth = 60480;
 
 
-/****************************************************************************/
-/*! Parses the commandline and stores all data in globals (shudder). Exits
-    the application with a failed exitcode if a parameter is illegal.
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Scripts are decoded once, when they are loaded, into a vector of
+ * Instructions that runs parallel to Source. The opcode and any numeric
+ * operands (coordinates, buttons, keysyms...) are parsed up front, so
+ * executing a line is a switch on the opcode instead of a stringstream and
+ * a chain of strcasecmp.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+enum OpCode {
+  OP_NOP = 0,
+  OP_COMMENT,
+  OP_END,
+  OP_ENDL,
+  OP_SET,
+  OP_INCREMENT,
+  OP_DECREMENT,
+  OP_FILEOPEN,
+  OP_FILEREADALL,
+  OP_FILELENGTH,
+  OP_IN,
+  OP_IF,
+  OP_ELSE,
+  OP_ENDIF,
+  OP_FOR,
+  OP_NEXT,
+  OP_WHILE,
+  OP_WEND,
+  OP_BREAKLOOP,
+  OP_RESTORE,         // the state at the checkpoint --start-at starts from
+  OP_CONTINUE,
+  OP_PREG,
+  OP_DELAY,
+  OP_SETMOUSEDELAY,
+  OP_SETKEYPRESSDELAY,
+  OP_SETDELAY,
+  OP_USLEEP,
+  OP_PRINT,
+  OP_RESTART,
+  OP_RETURN,
+  OP_BREAK,
+  OP_GOTO,
+  OP_CALL,
+  OP_LABEL,
+  OP_ENTRY,
+  OP_BUTTONPRESS,
+  OP_DOWN,
+  OP_CLICK,
+  OP_BUTTONRELEASE,
+  OP_UP,
+  OP_MOVE,
+  OP_RELATIVEMOVE,
+  OP_MOTIONNOTIFY,
+  OP_KEYCODEPRESS,
+  OP_KEYCODERELEASE,
+  OP_KEYSYM,
+  OP_KEYSYMPRESS,
+  OP_KEYSYMRELEASE,
+  OP_KEYSTR,
+  OP_KEYSTRPRESS,
+  OP_KEYSTRRELEASE,
+  OP_SEND,
+  OP_EXEC,
+  OP_MOVEWINDOW,
+  OP_FOCUS,
+  OP_WAITFORWINDOW,
+  OP_WAITFORMAP,
+  OP_WAITFORFOCUS,
+  OP_WAITFORCLOSE,
+  OP_WAITIDLE,
+  OP_WAITCHANGE,
+  OP_PIXELHASH,
+  OP_GETPIXEL,
+  OP_FINDIMAGE,
+  OP_DUMPFRAMES,
+  OP_INCLUDE,
+  OP_LAST             // keep this last, compiled scripts are checked against it
+};
 
-	\arg int argc - number of commandline arguments.
-	\arg char * argv[] - vector of the commandline argument strings.
-*/
-/****************************************************************************/
-void parseCommandLine (int argc, char * argv[]) {
+struct OpName {
+  const char * name;
+  OpCode op;
+};
+// command names are matched case insensitively
+static const OpName OpNames[] = {
+  { "End",              OP_END },
+  { "EndL",             OP_ENDL },
+  { "Set",              OP_SET },
+  { "FileOpen",         OP_FILEOPEN },
+  { "FileReadAll",      OP_FILEREADALL },
+  { "FileLength",       OP_FILELENGTH },
+  { "In",               OP_IN },
+  { "If",               OP_IF },
+  { "else",             OP_ELSE },
+  { "endif",            OP_ENDIF },
+  { "for",              OP_FOR },
+  { "next",             OP_NEXT },
+  { "while",            OP_WHILE },
+  { "wend",             OP_WEND },
+  { "continue",         OP_CONTINUE },
+  { "Preg",             OP_PREG },
+  { "Delay",            OP_DELAY },
+  { "SetMouseDelay",    OP_SETMOUSEDELAY },
+  { "SetKeyPressDelay", OP_SETKEYPRESSDELAY },
+  { "SetDelay",         OP_SETDELAY },
+  { "USleep",           OP_USLEEP },
+  { "Print",            OP_PRINT },
+  { "Restart",          OP_RESTART },
+  { "Return",           OP_RETURN },
+  { "Break",            OP_BREAK },
+  { "Goto",             OP_GOTO },
+  { "label",            OP_LABEL },
+  { "function",         OP_LABEL },
+  { "entry",            OP_ENTRY },
+  { "main",             OP_ENTRY },
+  { "ButtonPress",      OP_BUTTONPRESS },
+  { "Down",             OP_DOWN },
+  { "click",            OP_CLICK },
+  { "ButtonRelease",    OP_BUTTONRELEASE },
+  { "Up",               OP_UP },
+  { "Move",             OP_MOVE },
+  { "RelativeMove",     OP_RELATIVEMOVE },
+  { "MotionNotify",     OP_MOTIONNOTIFY },
+  { "KeyCodePress",     OP_KEYCODEPRESS },
+  { "KeyCodeRelease",   OP_KEYCODERELEASE },
+  { "KeySym",           OP_KEYSYM },
+  { "KeySymPress",      OP_KEYSYMPRESS },
+  { "KeySymRelease",    OP_KEYSYMRELEASE },
+  { "KeyStr",           OP_KEYSTR },
+  { "KeyStrPress",      OP_KEYSTRPRESS },
+  { "KeyStrRelease",    OP_KEYSTRRELEASE },
+  { "Send",             OP_SEND },
+  { "Exec",             OP_EXEC },
+  { "MoveWindow",       OP_MOVEWINDOW },
+  { "Focus",            OP_FOCUS },
+  { "WaitForWindow",    OP_WAITFORWINDOW },
+  { "WaitForMap",       OP_WAITFORMAP },
+  { "WaitForFocus",     OP_WAITFORFOCUS },
+  { "WaitForClose",     OP_WAITFORCLOSE },
+  { "WaitIdle",         OP_WAITIDLE },
+  { "WaitChange",       OP_WAITCHANGE },
+  { "PixelHash",        OP_PIXELHASH },
+  { "GetPixel",         OP_GETPIXEL },
+  { "FindImage",        OP_FINDIMAGE },
+  { "DumpFrames",       OP_DUMPFRAMES },
+  { "Include",          OP_INCLUDE },
+  { NULL,               OP_NOP }
+};
 
-  int Index = 1;
-  
-  // check the number of arguments
-  if ( argc < 2 ) {
-	// oops, too few arguments, go away
-	usage ( EXIT_FAILURE );
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * A compiled script is written and read with these, numbers are varints as
+ * in jayrecord.h. Register slots are written as an index into the register
+ * names at the start of the compiled script, starting at 1 with 0 for none,
+ * and come back as whatever slot that name has in the run that loads it.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+struct ImageWriter {
+  std::string out;
+  std::map<int,int> names;      // slot to its index in order
+  std::vector<int> order;       // the slots, in the order they were written
+  void Number(unsigned long v) {
+    putVarint(out, v);
+  }
+  void Signed(long v) {
+    putVarint(out, zigzag(v));
+  }
+  void Double(double d) {
+    unsigned long long bits;
+    memcpy(&bits, &d, sizeof(bits));
+    putVarint(out, (unsigned long)(bits & 0xFFFFFFFF));
+    putVarint(out, (unsigned long)(bits >> 32));
+  }
+  void String(const std::string &s) {
+    putVarint(out, s.size());
+    out += s;
+  }
+  void Slot(int slot) {
+    if (slot < 0) {
+      putVarint(out, 0);
+      return;
+    }
+    std::map<int,int>::iterator it = names.find(slot);
+    if (it == names.end()) {
+      it = names.insert(std::make_pair(slot, (int)order.size())).first;
+      order.push_back(slot);
+    }
+    putVarint(out, it->second + 1);
+  }
+};
+struct ImageReader {
+  const char * p;
+  const char * end;
+  std::vector<int> slots;
+  bool ok;              // false once anything didn't make sense
+  unsigned long Number() {
+    unsigned long v = 0;
+    if (!getVarint(p, end, v)) {
+      ok = false;
+    }
+    return v;
   }
+  long Signed() {
+    return unzigzag(Number());
+  }
+  double Double() {
+    unsigned long long bits = Number();
+    bits |= (unsigned long long)Number() << 32;
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+  }
+  void String(std::string &s) {
+    if (!getString(p, end, s)) {
+      ok = false;
+    }
+  }
+  // the text stays where it is, in the mapped file
+  boost::string_ref View() {
+    unsigned long n = Number();
+    if (!ok || (unsigned long)(end - p) < n) {
+      ok = false;
+      return boost::string_ref();
+    }
+    boost::string_ref view(p, n);
+    p += n;
+    return view;
+  }
+  int Slot() {
+    unsigned long i = Number();
+    if (i == 0 || i > slots.size()) {
+      ok = ok && i == 0;
+      return -1;
+    }
+    return slots[i - 1];
+  }
+  // a count of things that take at least a byte each
+  unsigned long Count() {
+    unsigned long n = Number();
+    if (n > (unsigned long)(end - p)) {
+      ok = false;
+      return 0;
+    }
+    return n;
+  }
+};
 
-  // loop through all arguments except the last, which is assumed to be the
-  // name of the display
-  while ( Index < argc ) {
-	
-	// is this '-v'?
-	if ( strcmp (argv[Index], "-v" ) == 0 ) {
-	  // yep, show version and exit
-	  version ();
-	}
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Expressions are compiled once into a small RPN program that is evaluated
+ * against the registers. From the lowest to the highest precedence:
+ *
+ *   a or b
+ *   a and b
+ *   a lt b, a gt b, a le b, a ge b      (1 or 0)
+ *   a + b, a - b
+ *   a * b, a / b, a % b
+ *   -a
+ *   numbers, ${register}, ( ... )
+ *
+ * Integers stay integers (10 / 4 is 2) until a double gets involved, or
+ * until the result doesn't fit in a long any more. Dividing by 0, or the
+ * smallest long by -1, is an error like a text that isn't a number.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#define _EXPR_MAX_DEPTH 64
 
-	// is this '-h'?
-	if ( strcmp (argv[Index], "-h" ) == 0 ) {
-	  // yep, show usage and exit
-	  usage ( EXIT_SUCCESS );
-	}
+enum ExprOpCode {
+  EX_INT,
+  EX_DOUBLE,
+  EX_REGISTER,
+  EX_NEG,
+  EX_ADD,
+  EX_SUB,
+  EX_MUL,
+  EX_DIV,
+  EX_MOD,
+  EX_LT,
+  EX_GT,
+  EX_LE,
+  EX_GE,
+  EX_AND,
+  EX_OR
+};
+struct ExprOp {
+  ExprOpCode op;
+  long i;               // value of EX_INT, slot of EX_REGISTER
+  double d;             // value of EX_DOUBLE
+};
+class Expression {
+  public:
+    // registers says whether ${name} is allowed in the text
+    bool Compile(const std::string &text, bool registers);
+    bool Evaluate(Variable &result) const;
+    bool IsConstant() const;
+    bool IsSum() const;
+    void Save(ImageWriter &w) const;
+    void Load(ImageReader &r);
+    bool Empty() const {
+      return p_code.empty();
+    }
+    void Clear() {
+      p_code.clear();
+    }
+  private:
+    std::vector<ExprOp> p_code;
+};
 
-	// is this '-d'?
-	else if ( strcmp (argv[Index], "-d" ) == 0 && Index + 1 < argc ) {
-	  // yep, and there seems to be a parameter too, interpret it as a
-	  // number
-	  if ( sscanf ( argv[Index + 1], "%d", &Delay ) != 1 ) {
-		// oops, not a valid intereger
-		std::cerr << "Invalid parameter for '-d'." << std::endl;
-		usage ( EXIT_FAILURE );
-	  }
-	  
-	  Index++;
-	}
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * A Template is the text of a Print, Set, If... split into literal pieces
+ * and register references when the script is loaded. The escapes \n, \t,
+ * \r and 0xNN are resolved at that point too, so rendering one is a single
+ * pass that appends the pieces.
+ *
+ * If the whole text is an expression ("${x} + 1") it is compiled as well and
+ * evaluated instead, text that isn't one never touches the expression code.
+ * A Print only ever worked out sums ("${x} + 1" prints the sum, "10 / 4"
+ * prints 10 / 4), so its text keeps the expression only when it is one,
+ * and it isn't folded at load time either.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+struct Segment {
+  int slot;             // register slot, -1 for a literal
+  std::string literal;
+};
+class Template {
+  public:
+    // expression is false for a Print, see above
+    void Compile(const std::string &text, bool expression = true);
+    bool IsConstant() const;
+    const std::string &Render(std::string &out) const;
+    void Write(std::ostream &os) const;
+    void Assign(Variable &v) const;
+    void Save(ImageWriter &w) const;
+    void Load(ImageReader &r);
+  private:
+    void renderText(std::string &out) const;
+    bool mayBeNumber() const;
+    std::vector<Segment> p_segments;
+    Expression p_expr;
+};
 
-	// is this '-s'?
-	else if ( strcmp (argv[Index], "-s" ) == 0 && Index + 1 < argc ) {
-	  // yep, and there seems to be a parameter too, interpret it as a
-	  // floating point number
-	  if ( sscanf ( argv[Index + 1], "%f", &Scale ) != 1 ) {
-		// oops, not a valid intereger
-		std::cerr << "Invalid parameter for '-s'." << std::endl;
-		usage ( EXIT_FAILURE );
-	  }
-	  
-	  Index++;
-	}
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * The condition of an If or of a post-if ("label if ${x} is 1"), split into
+ * its tokens when the script is loaded. A like whose pattern doesn't use any
+ * registers is compiled right away. Conditions without is, not or like
+ * ("if ${x} lt 10 and ${y} ge 2") are compiled as an Expression.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+struct Condition {
+  Template ltoken;
+  std::string comp;     // is, not or like, empty when expr is used
+  Template rtoken;
+  Expression expr;      // anything else, true when not 0
+  bool compiled;
+  boost::regex pattern;
+};
 
-	// is this the last parameter?
-	else if ( Index == argc - 2 ) {
-	  // yep, we assume it's the display, store it
-	  Remote = argv [ Index ];
-	}
+struct Instruction {
+  OpCode op;
+  std::string arg;    // first operand: register, label, file handle, keysym name
+  std::string arg2;   // second operand, the target register of File*
+  std::string text;   // rest of the line for Print, Set, Send, Exec...
+  int x, y;
+  int w, h;           // size of the region of PixelHash
+  unsigned int b;
+  long long ns;       // how long a Delay or USleep waits
+  KeySym ks;
+  KeyCode kc;
+  int reg;            // register slot of arg
+  int reg2;           // register slot of arg2
+  int target;         // resolved line index for Goto and label calls, where
+                      // a false If/For/While, an Else or a break continues,
+                      // the For/While a next or wend loops back to
+  bool tail;          // Goto/call directly followed by Return
+  bool postif;        // only run when cond is true
+  Condition cond;     // for If and post-if
+  Template value;     // text for Print, Set and FileOpen
+  std::vector<Expression> exprs;  // start, end and step of a For
+};
+std::vector<Instruction> Program;
 
-	else {
-	  // we got this far, the parameter is no good...
-	  //std::cerr << "Invalid parameter '" << argv[Index] << "'." << std::endl;
-	  //usage ( EXIT_FAILURE );
-	}
+// we put the function sigs here so that they are accessible
+static inline void executeInstruction(Instruction &ins);
+static inline void executeIf(Instruction &ins);
+static inline bool expressionResult(std::string &ltoken, 
+                                    std::string &comp, 
+                                    std::string & rtoken);
+static inline void saveRegexResult(boost::smatch &what);
+static Instruction * streamLine(int n);
+static int streamBlockTarget(Instruction &ins);
+static void streamFindLabel(Instruction &ins);
 
-	// next value
-	Index++;
+// the instruction at line, NULL past the end of the script
+static inline Instruction * programLine(int line) {
+  if (Streaming) {
+    return streamLine(line);
   }
+  return line < SourceNumLines ? &Program[line] : NULL;
+}
+// where a false If/For/While, an Else or a break goes
+static inline int blockTarget(Instruction &ins) {
+  return ins.target < 0 && Streaming ? streamBlockTarget(ins) : ins.target;
 }
 
-/****************************************************************************/
-/*! Connects to the desired display. Returns the \c Display or \c 0 if
-    no display could be obtained.
-
-	\arg const char * DisplayName - name of the remote display.
-*/
-/****************************************************************************/
-Display * remoteDisplay (const char * DisplayName) {
-
-  int Event, Error;
-  int Major, Minor;  
-
-  // open the display
-  Display * D = XOpenDisplay ( DisplayName );
 
-  // did we get it?
-  if ( ! D ) {
-	// nope, so show error and abort
-	std::cerr << PROG << ": could not open display \"" << XDisplayName ( DisplayName )
-		 << "\", aborting." << std::endl;
-	exit ( EXIT_FAILURE );
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Expression compiler, a recursive descent parser that emits RPN as it goes.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+enum ExprToken {
+  TK_END,
+  TK_ERROR,
+  TK_NUMBER,
+  TK_REGISTER,
+  TK_OPERATOR,
+  TK_LPAREN,
+  TK_RPAREN
+};
+struct ExprLexer {
+  const std::string * text;
+  size_t pos;
+  bool registers;
+  ExprToken token;    // the current token
+  ExprOp op;          // its value, for numbers, registers and operators
+  int depth;          // stack depth of the code emitted so far
+  int maxdepth;
+};
+static void nextToken(ExprLexer &lx) {
+  const std::string &s = *lx.text;
+  while (lx.pos < s.size() && isspace(s[lx.pos])) {
+    lx.pos++;
   }
-
-  // does the remote display have the Xtest-extension?
-  if ( ! XTestQueryExtension (D, &Event, &Error, &Major, &Minor ) ) {
-	// nope, extension not supported
-	std::cerr << PROG << ": XTest extension not supported on server \""
-		 << DisplayString(D) << "\"" << std::endl;
-
-	// close the display and go away
-	XCloseDisplay ( D );
-	exit ( EXIT_FAILURE );
+  if (lx.pos >= s.size()) {
+    lx.token = TK_END;
+    return;
   }
+  char c = s[lx.pos];
+  if (isdigit(c) || (c == '.' && lx.pos + 1 < s.size() && isdigit(s[lx.pos + 1]))) {
+    size_t start = lx.pos;
+    bool isint = true;
+    while (lx.pos < s.size() && isdigit(s[lx.pos])) lx.pos++;
+    if (lx.pos < s.size() && s[lx.pos] == '.') {
+      isint = false;
+      lx.pos++;
+      while (lx.pos < s.size() && isdigit(s[lx.pos])) lx.pos++;
+    }
+    if (lx.pos < s.size() && (s[lx.pos] == 'e' || s[lx.pos] == 'E')) {
+      size_t e = lx.pos + 1;
+      if (e < s.size() && (s[e] == '+' || s[e] == '-')) e++;
+      if (e < s.size() && isdigit(s[e])) {
+        isint = false;
+        lx.pos = e;
+        while (lx.pos < s.size() && isdigit(s[lx.pos])) lx.pos++;
+      }
+    }
+    std::string number = s.substr(start, lx.pos - start);
+    lx.token = TK_NUMBER;
+    if (isint && number.size() < 19) {
+      lx.op.op = EX_INT;
+      lx.op.i = strtol(number.c_str(), NULL, 10);
+    } else {
+      lx.op.op = EX_DOUBLE;
+      lx.op.d = strtod(number.c_str(), NULL);
+    }
+    return;
+  }
+  if (c == '$' && lx.pos + 1 < s.size() && s[lx.pos + 1] == '{') {
+    size_t end = s.find('}', lx.pos);
+    if (!lx.registers || end == std::string::npos) {
+      lx.token = TK_ERROR;
+      return;
+    }
+    lx.token = TK_REGISTER;
+    lx.op.op = EX_REGISTER;
+    lx.op.i = registerSlot(s.substr(lx.pos + 2, end - lx.pos - 2));
+    lx.pos = end + 1;
+    return;
+  }
+  if (isalpha(c)) {
+    static const struct { const char * name; ExprOpCode op; } words[] = {
+      { "lt", EX_LT }, { "gt", EX_GT }, { "le", EX_LE }, { "ge", EX_GE },
+      { "and", EX_AND }, { "or", EX_OR }, { NULL, EX_INT }
+    };
+    size_t start = lx.pos;
+    while (lx.pos < s.size() && isalpha(s[lx.pos])) lx.pos++;
+    std::string word = s.substr(start, lx.pos - start);
+    for (int i = 0; words[i].name; i++) {
+      if (word == words[i].name) {
+        lx.token = TK_OPERATOR;
+        lx.op.op = words[i].op;
+        return;
+      }
+    }
+    lx.token = TK_ERROR;
+    return;
+  }
+  lx.pos++;
+  lx.token = TK_OPERATOR;
+  switch (c) {
+    case '+': lx.op.op = EX_ADD; break;
+    case '-': lx.op.op = EX_SUB; break;
+    case '*': lx.op.op = EX_MUL; break;
+    case '/': lx.op.op = EX_DIV; break;
+    case '%': lx.op.op = EX_MOD; break;
+    case '(': lx.token = TK_LPAREN; break;
+    case ')': lx.token = TK_RPAREN; break;
+    default: lx.token = TK_ERROR; break;
+  }
+}
+static void emit(ExprLexer &lx, std::vector<ExprOp> &code, ExprOp op) {
+  code.push_back(op);
+  if (op.op == EX_INT || op.op == EX_DOUBLE || op.op == EX_REGISTER) {
+    lx.depth++;
+  } else if (op.op != EX_NEG) {
+    lx.depth--;
+  }
+  if (lx.depth > lx.maxdepth) {
+    lx.maxdepth = lx.depth;
+  }
+}
+static bool parseOr(ExprLexer &lx, std::vector<ExprOp> &code);
+static bool parseUnary(ExprLexer &lx, std::vector<ExprOp> &code) {
+  if (lx.token == TK_OPERATOR && lx.op.op == EX_SUB) {
+    ExprOp neg;
+    neg.op = EX_NEG;
+    nextToken(lx);
+    if (!parseUnary(lx, code)) {
+      return false;
+    }
+    emit(lx, code, neg);
+    return true;
+  }
+  if (lx.token == TK_NUMBER || lx.token == TK_REGISTER) {
+    emit(lx, code, lx.op);
+    nextToken(lx);
+    return true;
+  }
+  if (lx.token == TK_LPAREN) {
+    nextToken(lx);
+    if (!parseOr(lx, code) || lx.token != TK_RPAREN) {
+      return false;
+    }
+    nextToken(lx);
+    return true;
+  }
+  return false;
+}
+// one level of left associative binary operators from first to last
+static bool parseBinary(ExprLexer &lx, std::vector<ExprOp> &code,
+                        ExprOpCode first, ExprOpCode last,
+                        bool (*operand)(ExprLexer &, std::vector<ExprOp> &)) {
+  if (!operand(lx, code)) {
+    return false;
+  }
+  while (lx.token == TK_OPERATOR && lx.op.op >= first && lx.op.op <= last) {
+    ExprOp op = lx.op;
+    nextToken(lx);
+    if (!operand(lx, code)) {
+      return false;
+    }
+    emit(lx, code, op);
+  }
+  return true;
+}
+static bool parseProduct(ExprLexer &lx, std::vector<ExprOp> &code) {
+  return parseBinary(lx, code, EX_MUL, EX_MOD, parseUnary);
+}
+static bool parseSum(ExprLexer &lx, std::vector<ExprOp> &code) {
+  return parseBinary(lx, code, EX_ADD, EX_SUB, parseProduct);
+}
+static bool parseCompare(ExprLexer &lx, std::vector<ExprOp> &code) {
+  return parseBinary(lx, code, EX_LT, EX_GE, parseSum);
+}
+static bool parseAnd(ExprLexer &lx, std::vector<ExprOp> &code) {
+  return parseBinary(lx, code, EX_AND, EX_AND, parseCompare);
+}
+static bool parseOr(ExprLexer &lx, std::vector<ExprOp> &code) {
+  return parseBinary(lx, code, EX_OR, EX_OR, parseAnd);
+}
+bool Expression::Compile(const std::string &text, bool registers) {
+  ExprLexer lx;
+  lx.text = &text;
+  lx.pos = 0;
+  lx.registers = registers;
+  lx.depth = lx.maxdepth = 0;
+  p_code.clear();
+  nextToken(lx);
+  if (!parseOr(lx, p_code) || lx.token != TK_END || lx.maxdepth > _EXPR_MAX_DEPTH) {
+    p_code.clear();
+    return false;
+  }
+  return true;
+}
+bool Expression::IsConstant() const {
+  for (size_t i = 0; i < p_code.size(); i++) {
+    if (p_code[i].op == EX_REGISTER) {
+      return false;
+    }
+  }
+  return true;
+}
+// numbers and registers added and subtracted, all a Print works out
+bool Expression::IsSum() const {
+  for (size_t i = 0; i < p_code.size(); i++) {
+    switch (p_code[i].op) {
+      case EX_INT: case EX_DOUBLE: case EX_REGISTER: case EX_NEG: case EX_ADD: case EX_SUB:
+        break;
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+void Expression::Save(ImageWriter &w) const {
+  w.Number(p_code.size());
+  for (size_t i = 0; i < p_code.size(); i++) {
+    w.Number(p_code[i].op);
+    if (p_code[i].op == EX_INT) {
+      w.Signed(p_code[i].i);
+    } else if (p_code[i].op == EX_DOUBLE) {
+      w.Double(p_code[i].d);
+    } else if (p_code[i].op == EX_REGISTER) {
+      w.Slot(p_code[i].i);
+    }
+  }
+}
+void Expression::Load(ImageReader &r) {
+  p_code.resize(r.Count());
+  for (size_t i = 0; i < p_code.size() && r.ok; i++) {
+    ExprOp &op = p_code[i];
+    unsigned long code = r.Number();
+    op.op = code <= EX_OR ? (ExprOpCode)code : EX_INT;
+    op.i = 0;
+    op.d = 0;
+    if (op.op == EX_INT) {
+      op.i = r.Signed();
+    } else if (op.op == EX_DOUBLE) {
+      op.d = r.Double();
+    } else if (op.op == EX_REGISTER) {
+      op.i = r.Slot();
+      r.ok = r.ok && op.i >= 0;
+    }
+    r.ok = r.ok && code <= EX_OR;
+  }
+}
 
-  // print some information
-  std::cerr << "XTest for server \"" << DisplayString(D) << "\" is version "
-	   << Major << "." << Minor << "." << std::endl << std::endl;;
-
-  // execute requests even if server is grabbed 
-  XTestGrabControl ( D, True ); 
-
-  // sync the server
-  XSync ( D,True ); 
-
-  // return the display
-  return D;
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Run the RPN program. Returns false if a register doesn't hold a number or
+ * on an integer division by zero, result is left alone then.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+struct ExprValue {
+  bool isint;
+  long i;
+  double d;
+};
+static inline double exprDouble(const ExprValue &v) {
+  return v.isint ? (double)v.i : v.d;
+}
+static inline void exprSetInt(ExprValue &v, long i) {
+  v.isint = true;
+  v.i = i;
+}
+bool Expression::Evaluate(Variable &result) const {
+  ExprValue stack[_EXPR_MAX_DEPTH];
+  int sp = 0;
+  if (p_code.empty()) {
+    return false;
+  }
+  for (size_t n = 0; n < p_code.size(); n++) {
+    const ExprOp &op = p_code[n];
+    if (op.op == EX_INT) {
+      exprSetInt(stack[sp++], op.i);
+      continue;
+    }
+    if (op.op == EX_DOUBLE) {
+      stack[sp].isint = false;
+      stack[sp++].d = op.d;
+      continue;
+    }
+    if (op.op == EX_REGISTER) {
+      Variable &v = Registers[op.i];
+      if (!v.IsNumeric()) {
+        return false;
+      }
+      stack[sp].isint = v.Type() == _VINT;
+      if (stack[sp].isint) {
+        stack[sp].i = v.ToInt();
+      } else {
+        stack[sp].d = v.ToDouble();
+      }
+      sp++;
+      continue;
+    }
+    if (op.op == EX_NEG) {
+      if (stack[sp - 1].isint && stack[sp - 1].i != LONG_MIN) {
+        stack[sp - 1].i = -stack[sp - 1].i;
+      } else if (stack[sp - 1].isint) {
+        stack[sp - 1].isint = false;
+        stack[sp - 1].d = -(double)stack[sp - 1].i;
+      } else {
+        stack[sp - 1].d = -stack[sp - 1].d;
+      }
+      continue;
+    }
+    ExprValue &a = stack[sp - 2];
+    ExprValue &b = stack[sp - 1];
+    bool ints = a.isint && b.isint;
+    sp--;
+    switch (op.op) {
+      case EX_ADD:
+      case EX_SUB:
+      case EX_MUL:
+        if (ints) {
+          long i;
+          bool over = op.op == EX_ADD ? __builtin_add_overflow(a.i, b.i, &i) :
+                      (op.op == EX_SUB ? __builtin_sub_overflow(a.i, b.i, &i) :
+                                         __builtin_mul_overflow(a.i, b.i, &i));
+          if (!over) {
+            a.i = i;
+            break;
+          }
+        }
+        {
+          // a result that doesn't fit in a long becomes a double
+          double x = exprDouble(a), y = exprDouble(b);
+          a.d = op.op == EX_ADD ? x + y : (op.op == EX_SUB ? x - y : x * y);
+          a.isint = false;
+        }
+        break;
+      case EX_DIV:
+      case EX_MOD:
+        if (ints) {
+          if (b.i == 0) {
+            std::cerr << "Division by zero" << std::endl;
+            return false;
+          }
+          if (b.i == -1 && a.i == LONG_MIN) {
+            std::cerr << "Division overflows" << std::endl;
+            return false;
+          }
+          a.i = op.op == EX_DIV ? a.i / b.i : a.i % b.i;
+        } else {
+          double x = exprDouble(a), y = exprDouble(b);
+          a.d = op.op == EX_DIV ? x / y : fmod(x, y);
+          a.isint = false;
+        }
+        break;
+      case EX_LT: exprSetInt(a, exprDouble(a) <  exprDouble(b)); break;
+      case EX_GT: exprSetInt(a, exprDouble(a) >  exprDouble(b)); break;
+      case EX_LE: exprSetInt(a, exprDouble(a) <= exprDouble(b)); break;
+      case EX_GE: exprSetInt(a, exprDouble(a) >= exprDouble(b)); break;
+      case EX_AND: exprSetInt(a, exprDouble(a) != 0 && exprDouble(b) != 0); break;
+      case EX_OR:  exprSetInt(a, exprDouble(a) != 0 || exprDouble(b) != 0); break;
+      default: break;
+    }
+  }
+  if (stack[0].isint) {
+    result.SetInt(stack[0].i);
+  } else {
+    result.SetDouble(stack[0].d);
+  }
+  return true;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Template
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+// a register held something like "1 + 2", work it out like we always did
+static inline void normalizeNumber(std::string &s) {
+  size_t first = s.find_first_not_of(" \t");
+  if (first == std::string::npos || !(isdigit(s[first]) || strchr(".-(", s[first]))) {
+    return;
+  }
+  Expression expr;
+  Variable result;
+  if (expr.Compile(s, false) && expr.Evaluate(result)) {
+    s = result.ToString();
+  }
+}
+// what Print did with numbers: "1 + 2" prints 3, "10 / 4" stays text
+static inline void normalizeSum(std::string &s) {
+  Expression expr;
+  Variable result;
+  if (expr.Compile(s, false) && expr.IsSum() && expr.Evaluate(result)) {
+    s = result.ToString();
+  }
+}
+void Template::Compile(const std::string &text, bool expression) {
+  std::string literal;
+  Segment seg;
+  size_t i = 0;
+  p_segments.clear();
+  while (i < text.size()) {
+    char c = text[i];
+    if (c == '\\' && i + 1 < text.size() &&
+        (text[i + 1] == 'n' || text[i + 1] == 't' || text[i + 1] == 'r')) {
+      literal += text[i + 1] == 'n' ? '\n' : (text[i + 1] == 't' ? '\t' : '\r');
+      i += 2;
+    } else if (c == '0' && i + 2 < text.size() && text[i + 1] == 'x' && isxdigit(text[i + 2])) {
+      // 0x21 is a !, the number is at most two digits
+      std::string sub = text.substr(i,4);
+      literal += (char)strtoul(sub.c_str(), NULL, 16);
+      i += sub.size();
+    } else if (c == '$' && i + 1 < text.size() && text[i + 1] == '{' &&
+               text.find('}', i) != std::string::npos) {
+      size_t end = text.find('}', i);
+      if (!literal.empty()) {
+        seg.slot = -1;
+        seg.literal = literal;
+        p_segments.push_back(seg);
+        literal.clear();
+      }
+      seg.slot = registerSlot(text.substr(i + 2, end - i - 2));
+      seg.literal.clear();
+      p_segments.push_back(seg);
+      i = end + 1;
+    } else {
+      literal += c;
+      i++;
+    }
+  }
+  if (!literal.empty()) {
+    seg.slot = -1;
+    seg.literal = literal;
+    p_segments.push_back(seg);
+  }
+  if (!expression) {
+    if (!p_expr.Compile(text, true) || !p_expr.IsSum()) {
+      p_expr.Clear();
+    }
+  } else if (p_expr.Compile(text, true) && p_expr.IsConstant()) {
+    // nothing will ever change, so work out the number now
+    Variable result;
+    p_expr.Evaluate(result);
+    p_segments.clear();
+    seg.slot = -1;
+    seg.literal = result.ToString();
+    p_segments.push_back(seg);
+    p_expr.Clear();
+  }
+}
+void Template::Save(ImageWriter &w) const {
+  w.Number(p_segments.size());
+  for (size_t i = 0; i < p_segments.size(); i++) {
+    w.Slot(p_segments[i].slot);
+    if (p_segments[i].slot == -1) {
+      w.String(p_segments[i].literal);
+    }
+  }
+  p_expr.Save(w);
+}
+void Template::Load(ImageReader &r) {
+  p_segments.resize(r.Count());
+  for (size_t i = 0; i < p_segments.size() && r.ok; i++) {
+    p_segments[i].slot = r.Slot();
+    p_segments[i].literal.clear();
+    if (p_segments[i].slot == -1) {
+      r.String(p_segments[i].literal);
+    }
+  }
+  p_expr.Load(r);
+}
+bool Template::IsConstant() const {
+  for (size_t i = 0; i < p_segments.size(); i++) {
+    if (p_segments[i].slot != -1) {
+      return false;
+    }
+  }
+  return true;
+}
+void Template::renderText(std::string &out) const {
+  out.clear();
+  for (size_t i = 0; i < p_segments.size(); i++) {
+    if (p_segments[i].slot == -1) {
+      out += p_segments[i].literal;
+    } else {
+      out += Registers[p_segments[i].slot].ToString();
+    }
+  }
+}
+// could the text come out as a number, looking at its first character
+bool Template::mayBeNumber() const {
+  for (size_t i = 0; i < p_segments.size(); i++) {
+    const std::string &s = p_segments[i].slot == -1 ?
+                           p_segments[i].literal :
+                           Registers[p_segments[i].slot].ToString();
+    size_t first = s.find_first_not_of(" \t");
+    if (first != std::string::npos) {
+      return isdigit(s[first]) || strchr(".-(", s[first]);
+    }
+  }
+  return false;
+}
+const std::string &Template::Render(std::string &out) const {
+  static Variable result;
+  if (!p_expr.Empty()) {
+    if (p_expr.Evaluate(result)) {
+      out = result.ToString();
+      return out;
+    }
+    renderText(out);
+    normalizeNumber(out);
+    return out;
+  }
+  renderText(out);
+  return out;
+}
+void Template::Assign(Variable &v) const {
+  static std::string out;
+  if (!p_expr.Empty() && p_expr.Evaluate(v)) {
+    // the result goes straight into the register, no text involved
+    return;
+  }
+  v.Set(Render(out));
+}
+void Template::Write(std::ostream &os) const {
+  if (!p_expr.Empty()) {
+    static Variable result;
+    static std::string out;
+    if (p_expr.Evaluate(result)) {
+      os << result.ToString();
+      return;
+    }
+    if (mayBeNumber()) {
+      renderText(out);
+      normalizeSum(out);
+      os << out;
+      return;
+    }
+  }
+  // plain text, no need to put it together first
+  for (size_t i = 0; i < p_segments.size(); i++) {
+    if (p_segments[i].slot == -1) {
+      os << p_segments[i].literal;
+    } else {
+      os << Registers[p_segments[i].slot].ToString();
+    }
+  }
 }
 
 /****************************************************************************/
-/*! Scales the passed coordinate with the given saling factor. the factor is
-    either given as a commandline argument or it is 1.0.
+/*! Prints the usage, i.e. how the program is used. Exits the application with
+    the passed exit-code.
+
+	\arg const int ExitCode - the exitcode to use for exiting.
 */
 /****************************************************************************/
-int scale (const int Coordinate) {
+void usage (const int exitCode) {
 
-  // perform the scaling, all in one ugly line
-  return (int)( (float)Coordinate * Scale );
+  // print the usage
+  std::cerr << PROG << " " << VERSION << std::endl;
+  std::cerr << "Usage: " << PROG << " [options] remote_display [script]" << std::endl;
+  std::cerr << "Options: " << std::endl;
+  std::cerr << "  -d  DELAY   delay in milliseconds for events sent to remote display." << std::endl
+	   << "              Default: 10ms."
+	   << std::endl
+	   << "  -s  FACTOR  scalefactor for coordinates. Default: 1.0." << std::endl
+	   << "  -S          stream the script, play it as it is read. Always on" << std::endl
+	   << "              when the script is read from stdin (no script or -)." << std::endl
+	   << "  -W  LINES   lines kept in memory when streaming. Default: 4096." << std::endl
+	   << "  -B  EVENTS  send fake events after this many are queued. Default: 256." << std::endl
+	   << "  -L  MS      or once the first has waited this long, -1 to only send" << std::endl
+	   << "              them at delays, Exec and End. Default: 20ms." << std::endl
+	   << "  -c          keep the decoded script in script.jayc next to it and use" << std::endl
+	   << "              that while the script doesn't change." << std::endl
+	   << "  -C  DIR     the same, but in DIR." << std::endl
+	   << "  --start-at CHECKPOINT|TIME" << std::endl
+	   << "              play a binary recording from a checkpoint, by its number" << std::endl
+	   << "              or by time as 90s, 1:30 or 1:01:30." << std::endl
+	   << "  -p  PIXELS  leave out the MotionNotify lines that stray at most this" << std::endl
+	   << "              far from the path of the ones played. Not when streaming." << std::endl
+	   << "  -g  MS      and those that come sooner than this after the last one." << std::endl
+	   << "  --speed F   play delays and the recorded pauses F times as fast." << std::endl
+	   << "  --idle MS   cut any delay or pause longer than MS to MS." << std::endl
+	   << "  --fb FILE   read the screen from the framebuffer Xvfb -fbdir writes," << std::endl
+	   << "              e.g. /tmp/Xvfb_screen0, instead of asking the server." << std::endl
+	   << "  --frames FPS" << std::endl
+	   << "              keep the last seconds of the screen in memory, grabbed FPS" << std::endl
+	   << "              times a second. DumpFrames, End with a code other than 0," << std::endl
+	   << "              SIGINT, SIGTERM and SIGUSR1 write them out as PNGs." << std::endl
+	   << "  --frames-keep SECONDS" << std::endl
+	   << "              how many seconds. Default: 10." << std::endl
+	   << "  --frames-mem MB" << std::endl
+	   << "              at most this much memory for them. Default: 64." << std::endl
+	   << "  --frames-dir DIR" << std::endl
+	   << "              where they are written. Default: frames." << std::endl
+	   << "  -v          show version. " << std::endl
+	   << "  -h          this help. " << std::endl << std::endl;
+
+  // we're done
+  exit ( EXIT_SUCCESS );
 }
 
+
 /****************************************************************************/
-/*! Sends a \a character to the remote display \a RemoteDpy. The character is
-    converted to a \c KeySym based on a character table and then reconverted to
-	a \c KeyCode on the remote display. Seems to work quite ok, apart from
-	something weird with the Alt key.
+/*! Prints the version of the application and exits.
+*/
+/****************************************************************************/
+void version () {
 
-    \arg Display * RemoteDpy - used display.
-	\arg char c - character to send.
+  // print the version
+  std::cerr << PROG << " " << VERSION << std::endl;
+ 
+  // we're done
+  exit ( EXIT_SUCCESS );
+}
+
+
+/****************************************************************************/
+/*! Parses the commandline and stores all data in globals (shudder). Exits
+    the application with a failed exitcode if a parameter is illegal.
+
+	\arg int argc - number of commandline arguments.
+	\arg char * argv[] - vector of the commandline argument strings.
 */
 /****************************************************************************/
-void sendChar(Display *RemoteDpy, char c)
-{
-	KeySym ks, sks, *kss, ksl, ksu;
-	KeyCode kc, skc;
-	int syms;
-#ifdef DEBUG
-	int i;
-#endif
+void parseCommandLine (int argc, char * argv[]) {
 
-	sks=XK_Shift_L;
+  int Index = 1;
+  
+  // check the number of arguments
+  if ( argc < 2 ) {
+	// oops, too few arguments, go away
+	usage ( EXIT_FAILURE );
+  }
 
-	ks=XStringToKeysym(chartbl[0][(unsigned char)c]);
-	if ( ( kc = XKeysymToKeycode ( RemoteDpy, ks ) ) == 0 )
-	{
-  		std::cerr << "No keycode on remote display found for char: " << c << std::endl;
-	  	return;
-	}
-	if ( ( skc = XKeysymToKeycode ( RemoteDpy, sks ) ) == 0 )
-	{
-  		std::cerr << "No keycode on remote display found for XK_Shift_L!" << std::endl;
-	  	return;
+  // loop through all arguments except the last, which is assumed to be the
+  // name of the display
+  while ( Index < argc ) {
+	
+	// is this '-v'?
+	if ( strcmp (argv[Index], "-v" ) == 0 ) {
+	  // yep, show version and exit
+	  version ();
 	}
 
-	kss=XGetKeyboardMapping(RemoteDpy, kc, 1, &syms);
-	if (!kss)
-	{
-  		std::cerr << "XGetKeyboardMapping failed on the remote display (keycode: " << kc << ")" << std::endl;
-	  	return;
+	// is this '-h'?
+	if ( strcmp (argv[Index], "-h" ) == 0 ) {
+	  // yep, show usage and exit
+	  usage ( EXIT_SUCCESS );
 	}
-	for (; syms && (!kss[syms-1]); syms--);
-	if (!syms)
-	{
-  		std::cerr << "XGetKeyboardMapping failed on the remote display (no syms) (keycode: " << kc << ")" << std::endl;
-		XFree(kss);
-	  	return;
+
+	// is this '-d'?
+	else if ( strcmp (argv[Index], "-d" ) == 0 && Index + 1 < argc ) {
+	  // yep, and there seems to be a parameter too, interpret it as a
+	  // number
+	  if ( sscanf ( argv[Index + 1], "%d", &Delay ) != 1 ) {
+		// oops, not a valid intereger
+		std::cerr << "Invalid parameter for '-d'." << std::endl;
+		usage ( EXIT_FAILURE );
+	  }
+	  
+	  Index++;
 	}
-	XConvertCase(ks,&ksl,&ksu);
-#ifdef DEBUG
-	std::cout << "kss: ";
-	for (i=0; i<syms; i++) std::cout << kss[i] << " ";
-	std::cout << "(" << ks << " l: " << ksl << "  h: " << ksu << ")" << std::endl;
-#endif
-	if (ks==kss[0] && (ks==ksl && ks==ksu)) sks=NoSymbol;
-	if (ks==ksl && ks!=ksu) sks=NoSymbol;
-	if (sks!=NoSymbol) XTestFakeKeyEvent ( RemoteDpy, skc, True, Delay );
-	XTestFakeKeyEvent ( RemoteDpy, kc, True, Delay );
-	XFlush ( RemoteDpy );
-	XTestFakeKeyEvent ( RemoteDpy, kc, False, Delay );
-	if (sks!=NoSymbol) XTestFakeKeyEvent ( RemoteDpy, skc, False, Delay );
-	XFlush ( RemoteDpy );
-	XFree(kss);
-}
-/*
- Trim whitespace so scripts can be well formatted.
-*/
-char* trimWhitespace(char *str)
-{
-  char *end;
 
-  // Trim leading space
-  while(isspace(*str)) str++;
+	// is this '-s'?
+	else if ( strcmp (argv[Index], "-s" ) == 0 && Index + 1 < argc ) {
+	  // yep, and there seems to be a parameter too, interpret it as a
+	  // floating point number
+	  if ( sscanf ( argv[Index + 1], "%f", &Scale ) != 1 ) {
+		// oops, not a valid intereger
+		std::cerr << "Invalid parameter for '-s'." << std::endl;
+		usage ( EXIT_FAILURE );
+	  }
+	  
+	  Index++;
+	}
 
-  if(*str == 0)  // All spaces?
-    return str;
+	// is this '-S'?
+	else if ( strcmp (argv[Index], "-S" ) == 0 ) {
+	  Streaming = true;
+	}
 
-  // Trim trailing space
+	// is this '-W'?
+	else if ( strcmp (argv[Index], "-W" ) == 0 && Index + 1 < argc ) {
+	  if ( sscanf ( argv[Index + 1], "%d", &StreamWindow ) != 1 || StreamWindow < 1 ) {
+		std::cerr << "Invalid parameter for '-W'." << std::endl;
+		usage ( EXIT_FAILURE );
+	  }
+	  
+	  Index++;
+	}
+
+	// is this '-B'?
+	else if ( strcmp (argv[Index], "-B" ) == 0 && Index + 1 < argc ) {
+	  if ( sscanf ( argv[Index + 1], "%d", &FlushBatch ) != 1 || FlushBatch < 1 ) {
+		std::cerr << "Invalid parameter for '-B'." << std::endl;
+		usage ( EXIT_FAILURE );
+	  }
+
+	  Index++;
+	}
+
+	// is this '-L'?
+	else if ( strcmp (argv[Index], "-L" ) == 0 && Index + 1 < argc ) {
+	  if ( sscanf ( argv[Index + 1], "%d", &FlushLatency ) != 1 ) {
+		std::cerr << "Invalid parameter for '-L'." << std::endl;
+		usage ( EXIT_FAILURE );
+	  }
+
+	  Index++;
+	}
+
+	// is this '-c'?
+	else if ( strcmp (argv[Index], "-c" ) == 0 ) {
+	  Compiled = true;
+	}
+
+	// is this '-C'?
+	else if ( strcmp (argv[Index], "-C" ) == 0 && Index + 1 < argc ) {
+	  Compiled = true;
+	  CompiledDir = argv [ Index + 1 ];
+
+	  Index++;
+	}
+
+	// is this '--start-at'?
+	else if ( strcmp (argv[Index], "--start-at" ) == 0 && Index + 1 < argc ) {
+	  unsigned long h = 0, m = 0, s = 0;
+	  char c;
+	  const char * arg = argv[Index + 1];
+	  StartAt = true;
+	  if ( sscanf ( arg, "%lu:%lu:%lu%c", &h, &m, &s, &c ) == 3 ||
+		   ( sscanf ( arg, "%lu:%lu%c", &m, &s, &c ) == 2 && ( h = 0 ) == 0 ) ||
+		   ( sscanf ( arg, "%lu%c%c", &s, &c, &c ) == 2 && c == 's' && ( h = m = 0 ) == 0 ) ) {
+		StartAtTime = true;
+		StartAtValue = ( ( h * 60 + m ) * 60 + s ) * 1000;
+	  } else if ( sscanf ( arg, "%lu%c", &StartAtValue, &c ) != 1 ) {
+		std::cerr << "Invalid parameter for '--start-at'." << std::endl;
+		usage ( EXIT_FAILURE );
+	  }
+
+	  Index++;
+	}
+
+	// is this '-p'?
+	else if ( strcmp (argv[Index], "-p" ) == 0 && Index + 1 < argc ) {
+	  if ( sscanf ( argv[Index + 1], "%lf", &PathTolerance ) != 1 || PathTolerance < 0 ) {
+		std::cerr << "Invalid parameter for '-p'." << std::endl;
+		usage ( EXIT_FAILURE );
+	  }
+
+	  Index++;
+	}
+
+	// is this '-g'?
+	else if ( strcmp (argv[Index], "-g" ) == 0 && Index + 1 < argc ) {
+	  if ( sscanf ( argv[Index + 1], "%lu", &PathGap ) != 1 ) {
+		std::cerr << "Invalid parameter for '-g'." << std::endl;
+		usage ( EXIT_FAILURE );
+	  }
+
+	  Index++;
+	}
+
+	// is this '--speed'?
+	else if ( strcmp (argv[Index], "--speed" ) == 0 && Index + 1 < argc ) {
+	  if ( sscanf ( argv[Index + 1], "%lf", &Speed ) != 1 || Speed <= 0 ) {
+		std::cerr << "Invalid parameter for '--speed'." << std::endl;
+		usage ( EXIT_FAILURE );
+	  }
+
+	  Index++;
+	}
+
+	// is this '--idle'?
+	else if ( strcmp (argv[Index], "--idle" ) == 0 && Index + 1 < argc ) {
+	  long ms;
+	  if ( sscanf ( argv[Index + 1], "%ld", &ms ) != 1 || ms < 0 ) {
+		std::cerr << "Invalid parameter for '--idle'." << std::endl;
+		usage ( EXIT_FAILURE );
+	  }
+	  IdleLimit = ms * 1000000LL;
+
+	  Index++;
+	}
+
+	else if ( strcmp (argv[Index], "--frames" ) == 0 && Index + 1 < argc ) {
+	  if ( sscanf ( argv[Index + 1], "%lf", &FrameRate ) != 1 || FrameRate <= 0 || FrameRate > 100 ) {
+		std::cerr << "Invalid parameter for '--frames'." << std::endl;
+		usage ( EXIT_FAILURE );
+	  }
+
+	  Index++;
+	}
+
+	else if ( strcmp (argv[Index], "--frames-keep" ) == 0 && Index + 1 < argc ) {
+	  double seconds;
+	  if ( sscanf ( argv[Index + 1], "%lf", &seconds ) != 1 || seconds <= 0 ) {
+		std::cerr << "Invalid parameter for '--frames-keep'." << std::endl;
+		usage ( EXIT_FAILURE );
+	  }
+	  FrameKeep = (long long)(seconds * 1e9);
+
+	  Index++;
+	}
+
+	else if ( strcmp (argv[Index], "--frames-mem" ) == 0 && Index + 1 < argc ) {
+	  unsigned long mb;
+	  if ( sscanf ( argv[Index + 1], "%lu", &mb ) != 1 || mb == 0 ) {
+		std::cerr << "Invalid parameter for '--frames-mem'." << std::endl;
+		usage ( EXIT_FAILURE );
+	  }
+	  FrameMemory = mb << 20;
+
+	  Index++;
+	}
+
+	else if ( strcmp (argv[Index], "--fb" ) == 0 && Index + 1 < argc ) {
+	  FramebufferName = argv[Index + 1];
+
+	  Index++;
+	}
+
+	else if ( strcmp (argv[Index], "--frames-dir" ) == 0 && Index + 1 < argc ) {
+	  FrameDir = argv[Index + 1];
+
+	  Index++;
+	}
+
+	// the first one that isn't an option is the display
+	else if ( Remote == NULL ) {
+	  Remote = argv [ Index ];
+	}
+
+	// and then the script
+	else if ( ScriptName == NULL ) {
+	  ScriptName = argv [ Index ];
+	}
+
+	else {
+	  // we got this far, the parameter is no good...
+	  //std::cerr << "Invalid parameter '" << argv[Index] << "'." << std::endl;
+	  //usage ( EXIT_FAILURE );
+	}
+
+	// next value
+	Index++;
+  }
+
+  // without a script we play whatever comes in on stdin
+  if ( ScriptName == NULL || strcmp ( ScriptName, "-" ) == 0 ) {
+	Streaming = true;
+  }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Every fake event goes through these. Xlib queues the requests in its
+ * output buffer and they are only flushed at a timing boundary (Delay,
+ * USleep, a click, End), before jayplay waits on something else (Exec, In,
+ * a pipe that has no more lines yet, a file that may be a pipe too), or
+ * once FlushBatch events or FlushLatency ms have built up. The latency is
+ * checked before every line as well, so events don't sit in the buffer
+ * while the script does other work. A run of events with nothing in
+ * between goes out in a single write instead of one per event.
+ *
+ * An XTest error comes back long after its request was sent, it is reported
+ * by xtestError and the script carries on. Any other error is left to the
+ * handler Xlib had before.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+int Queued = 0;                 // events since the last flush
+long long QueuedSince;          // when the first of them was queued
+unsigned long Injected = 0;
+unsigned long Flushes = 0;
+int XTestOpcode = -1;
+unsigned long XTestErrors = 0;
+int (*DefaultErrorHandler)(Display *, XErrorEvent *) = NULL;
+
+static int xtestError(Display * RemoteDpy, XErrorEvent * ev) {
+  if (ev->request_code != XTestOpcode) {
+    return DefaultErrorHandler(RemoteDpy, ev);
+  }
+  char text[256];
+  XGetErrorText(RemoteDpy, ev->error_code, text, sizeof(text));
+  std::cerr << PROG << ": fake event " << ev->serial << " failed: " << text << std::endl;
+  XTestErrors++;
+  return 0;
+}
+static inline long long monotonicNow() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+static void flushEvents() {
+  if (Queued > 0) {
+    XFlush(GlobalDisplay);
+    Flushes++;
+    Queued = 0;
+  }
+}
+// flushes once the oldest queued event has waited FlushLatency ms
+static inline void flushLate() {
+  if (Queued > 0 && FlushLatency >= 0 && monotonicNow() - QueuedSince >= FlushLatency * 1000000LL) {
+    flushEvents();
+  }
+}
+static inline void queued() {
+  Injected++;
+  if (Queued++ == 0) {
+    QueuedSince = monotonicNow();
+    return;
+  }
+  if (Queued >= FlushBatch) {
+    flushEvents();
+  } else {
+    flushLate();
+  }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * The timeline. A wait (Delay, USleep, the pause of a click) is planned
+ * against an absolute CLOCK_MONOTONIC deadline, the previous deadline plus
+ * the wait, and slept off with clock_nanosleep(TIMER_ABSTIME). Running the
+ * script and waking up late don't add up over a long replay that way, a
+ * wait that starts late is simply shorter. The server waits out the XTest
+ * delay of a fake event by itself, from when it gets it, so that moves the
+ * deadline along too.
+ *
+ * After waiting on something outside the script (In, a pipe) the timeline
+ * starts over. How late the waits woke up is printed when jayplay exits.
+ *
+ * Every wait is cut to --idle first and then divided by --speed, so a
+ * recording made with its pauses can play faster than it was made.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+long long Deadline = 0;         // 0 when the timeline starts at the next event
+unsigned long Waits = 0;
+long long Lateness = 0;         // ns, all the waits together
+long long MaxLateness = 0;
+unsigned long IdleCut = 0;      // waits that were cut to IdleLimit
+
+// the server waits delay ms before it plays the event that was just queued
+static inline void timelineEvent(unsigned long delay) {
+  long long now = monotonicNow();
+  if (Deadline < now) {
+    Deadline = now;
+  }
+  Deadline += delay * 1000000LL;
+}
+static void windowUpdate(Display * dpy);
+static void timelineWait(long long ns) {
+  struct timespec at;
+  if (IdleLimit >= 0 && ns > IdleLimit) {
+    ns = IdleLimit;
+    IdleCut++;
+  }
+  if (Speed != 1.0) {
+    ns = (long long)(ns / Speed);
+  }
+  if (Deadline == 0) {
+    Deadline = monotonicNow();
+  }
+  Deadline += ns;
+  // whatever comes before the wait goes out now, and the window index
+  // catches up on what happened meanwhile
+  flushEvents();
+  windowUpdate(GlobalDisplay);
+  at.tv_sec = Deadline / 1000000000LL;
+  at.tv_nsec = Deadline % 1000000000LL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR) {}
+  long long late = monotonicNow() - Deadline;
+  Waits++;
+  Lateness += late;
+  if (late > MaxLateness) {
+    MaxLateness = late;
+  }
+}
+static inline void timelineRestart() {
+  Deadline = 0;
+}
+static inline void fakeKey(Display * RemoteDpy, unsigned int kc, Bool press, unsigned long delay) {
+  XTestFakeKeyEvent(RemoteDpy, kc, press, delay);
+  timelineEvent(delay);
+  queued();
+}
+static inline void fakeButton(Display * RemoteDpy, unsigned int b, Bool press, unsigned long delay) {
+  XTestFakeButtonEvent(RemoteDpy, b, press, delay);
+  timelineEvent(delay);
+  queued();
+}
+static inline void fakeMotion(Display * RemoteDpy, int x, int y, unsigned long delay) {
+  XTestFakeMotionEvent(RemoteDpy, GlobalScreen, x, y, delay);
+  timelineEvent(delay);
+  queued();
+}
+static inline void fakeRelativeMotion(Display * RemoteDpy, int x, int y, unsigned long delay) {
+  XTestFakeRelativeMotionEvent(RemoteDpy, x, y, delay);
+  timelineEvent(delay);
+  queued();
+}
+
+/****************************************************************************/
+/*! Connects to the desired display. Returns the \c Display or \c 0 if
+    no display could be obtained.
+
+	\arg const char * DisplayName - name of the remote display.
+*/
+/****************************************************************************/
+Display * remoteDisplay (const char * DisplayName) {
+
+  int Event, Error;
+  int Major, Minor;  
+
+  // open the display
+  Display * D = XOpenDisplay ( DisplayName );
+
+  // did we get it?
+  if ( ! D ) {
+	// nope, so show error and abort
+	std::cerr << PROG << ": could not open display \"" << XDisplayName ( DisplayName )
+		 << "\", aborting." << std::endl;
+	exit ( EXIT_FAILURE );
+  }
+
+  // does the remote display have the Xtest-extension?
+  if ( ! XTestQueryExtension (D, &Event, &Error, &Major, &Minor ) ) {
+	// nope, extension not supported
+	std::cerr << PROG << ": XTest extension not supported on server \""
+		 << DisplayString(D) << "\"" << std::endl;
+
+	// close the display and go away
+	XCloseDisplay ( D );
+	exit ( EXIT_FAILURE );
+  }
+
+  // print some information
+  std::cerr << "XTest for server \"" << DisplayString(D) << "\" is version "
+	   << Major << "." << Minor << "." << std::endl << std::endl;;
+
+  // XTest errors are reported, they don't end the program
+  if ( XQueryExtension ( D, XTestExtensionName, &XTestOpcode, &Event, &Error ) ) {
+	DefaultErrorHandler = XSetErrorHandler ( xtestError );
+  }
+
+  // execute requests even if server is grabbed 
+  XTestGrabControl ( D, True ); 
+
+  // sync the server
+  XSync ( D,True ); 
+
+  // return the display
+  return D;
+}
+
+/****************************************************************************/
+/*! Scales the passed coordinate with the given saling factor. the factor is
+    either given as a commandline argument or it is 1.0.
+*/
+/****************************************************************************/
+int scale (const int Coordinate) {
+
+  // perform the scaling, all in one ugly line
+  return (int)( (float)Coordinate * Scale );
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * A snapshot of the keyboard mapping of the remote display, fetched with one
+ * XGetKeyboardMapping the first time a key is sent and again after a
+ * MappingNotify. Keysyms are looked up in it the way XKeysymToKeycode does,
+ * the first keycode that has it, column by column. What sendChar needs for
+ * every character (the keycode and whether Shift goes with it) is worked
+ * out when it is fetched, so typing a string doesn't ask the server anything.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+struct CharKey {
+  KeySym ks;
+  KeyCode kc;           // 0 when the display has no key for it
+  bool shift;
+  bool mapped;          // false when the keycode has no keysyms at all
+};
+struct KeyboardMap {
+  bool valid;
+  int min, max, per;
+  std::vector<KeySym> syms;
+  std::unordered_map<KeySym,KeyCode> codes;
+  CharKey chars[256];
+  KeyCode shift;
+};
+KeyboardMap Keymap;
+
+// the keysym in column col of keycode, the way Xlib's KeyCodetoKeySym has it
+static KeySym keymapSym(int keycode, int col) {
+  int per = Keymap.per;
+  KeySym lsym, usym;
+  if (col < 0 || (col >= per && col > 3) || keycode < Keymap.min || keycode > Keymap.max) {
+    return NoSymbol;
+  }
+  const KeySym * syms = &Keymap.syms[(keycode - Keymap.min) * per];
+  if (col < 4) {
+    if (col > 1) {
+      while (per > 2 && syms[per - 1] == NoSymbol) {
+        per--;
+      }
+      if (per < 3) {
+        col -= 2;
+      }
+    }
+    if (per <= (col | 1) || syms[col | 1] == NoSymbol) {
+      XConvertCase(syms[col & ~1], &lsym, &usym);
+      if (!(col & 1)) {
+        return lsym;
+      }
+      return usym == lsym ? NoSymbol : usym;
+    }
+  }
+  return syms[col];
+}
+static inline KeyCode keymapCode(KeySym ks) {
+  std::unordered_map<KeySym,KeyCode>::iterator it = Keymap.codes.find(ks);
+  return it == Keymap.codes.end() ? 0 : it->second;
+}
+static void keymapFetch(Display * RemoteDpy) {
+  int count, kc, col, c;
+  KeySym * syms;
+  Keymap.syms.clear();
+  Keymap.codes.clear();
+  Keymap.per = 0;
+  XDisplayKeycodes(RemoteDpy, &Keymap.min, &Keymap.max);
+  count = Keymap.max - Keymap.min + 1;
+  syms = XGetKeyboardMapping(RemoteDpy, Keymap.min, count, &Keymap.per);
+  if (syms) {
+    Keymap.syms.assign(syms, syms + count * Keymap.per);
+    XFree(syms);
+  } else {
+    Keymap.per = 0;
+  }
+  for (col = 0; col < Keymap.per; col++) {
+    for (kc = Keymap.min; kc <= Keymap.max; kc++) {
+      KeySym ks = keymapSym(kc, col);
+      if (ks != NoSymbol) {
+        // insert keeps the first one
+        Keymap.codes.insert(std::make_pair(ks, (KeyCode)kc));
+      }
+    }
+  }
+  Keymap.shift = keymapCode(XK_Shift_L);
+  for (c = 0; c < 256; c++) {
+    CharKey &key = Keymap.chars[c];
+    KeySym ksl, ksu;
+    key.ks = XStringToKeysym(chartbl[0][c]);
+    key.kc = keymapCode(key.ks);
+    key.mapped = false;
+    key.shift = false;
+    if (key.kc == 0) {
+      continue;
+    }
+    const KeySym * row = &Keymap.syms[(key.kc - Keymap.min) * Keymap.per];
+    int n = Keymap.per;
+    for (; n && !row[n - 1]; n--);
+    key.mapped = n > 0;
+    // Shift unless it is the unshifted keysym of the key, or a lower case letter
+    XConvertCase(key.ks, &ksl, &ksu);
+    key.shift = !((key.ks == row[0] && key.ks == ksl && key.ks == ksu) ||
+                  (key.ks == ksl && key.ks != ksu));
+  }
+  Keymap.valid = true;
+}
+// fetches it when it isn't there yet or a MappingNotify came in since
+static void keymapCheck(Display * RemoteDpy) {
+  XEvent ev;
+  // only looks at what has come in, this doesn't wait for the server
+  if (XEventsQueued(RemoteDpy, QueuedAfterReading) > 0) {
+    while (XCheckTypedEvent(RemoteDpy, MappingNotify, &ev)) {
+      XRefreshKeyboardMapping(&ev.xmapping);
+      if (ev.xmapping.request != MappingPointer) {
+        Keymap.valid = false;
+      }
+    }
+  }
+  if (!Keymap.valid) {
+    keymapFetch(RemoteDpy);
+  }
+}
+static inline KeyCode keysymToKeycode(Display * RemoteDpy, KeySym ks) {
+  keymapCheck(RemoteDpy);
+  return keymapCode(ks);
+}
+
+/****************************************************************************/
+/*! Sends a \a character to the remote display \a RemoteDpy. The character is
+    converted to a \c KeySym based on a character table and then reconverted to
+	a \c KeyCode with the snapshot in \c Keymap. Seems to work quite ok, apart
+	from something weird with the Alt key.
+
+    \arg Display * RemoteDpy - used display.
+	\arg char c - character to send.
+*/
+/****************************************************************************/
+void sendChar(Display *RemoteDpy, char c)
+{
+	if ( ! Keymap.valid ) {
+		keymapFetch ( RemoteDpy );
+	}
+	const CharKey &key = Keymap.chars[(unsigned char)c];
+
+	if ( key.kc == 0 )
+	{
+  		std::cerr << "No keycode on remote display found for char: " << c << std::endl;
+	  	return;
+	}
+	if ( Keymap.shift == 0 )
+	{
+  		std::cerr << "No keycode on remote display found for XK_Shift_L!" << std::endl;
+	  	return;
+	}
+	if ( ! key.mapped )
+	{
+  		std::cerr << "XGetKeyboardMapping failed on the remote display (no syms) (keycode: " << key.kc << ")" << std::endl;
+	  	return;
+	}
+	if (key.shift) fakeKey ( RemoteDpy, Keymap.shift, True, Delay );
+	fakeKey ( RemoteDpy, key.kc, True, Delay );
+	fakeKey ( RemoteDpy, key.kc, False, Delay );
+	if (key.shift) fakeKey ( RemoteDpy, Keymap.shift, False, Delay );
+}
+/*
+ Trim whitespace so scripts can be well formatted.
+*/
+char* trimWhitespace(char *str)
+{
+  char *end;
+
+  // Trim leading space
+  while(isspace(*str)) str++;
+
+  if(*str == 0)  // All spaces?
+    return str;
+
+  // Trim trailing space
   end = str + strlen(str) - 1;
   while(end > str && isspace(*end)) end--;
 
-  // Write new null terminator
-  *(end+1) = 0;
-  return str;
+  // Write new null terminator
+  *(end+1) = 0;
+  return str;
+}
+/*****************************************************************************
+ * Convert std::string to char *
+ * **************************************************************************/
+
+char * stringToCharz(std::string str) {
+  char * new_str = new char[str.size() + 1];
+  std::copy(str.begin(), str.end(), new_str);
+  new_str[str.size()] = '\0';
+  return new_str;
+}
+double stringToDouble(std::string str) {
+  std::stringstream s;
+  s.str(str);
+  double d;
+  s >> d;
+  return d;
+}
+int stringToInt(std::string str) {
+  std::stringstream s;
+  s.str(str);
+  int d;
+  s >> d;
+  return d;
+}
+std::string doubleToString(double d) {
+  std::stringstream s;
+  s.str("");
+  s << d;
+  return s.str();
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * WaitIdle and WaitChange follow the DAMAGE extension instead of sleeping.
+ * A script that has either of them creates a damage object on the root when
+ * it starts (a streamed one at its first wait), the server then reports
+ * every rectangle that is drawn on the screen. The reports come in with
+ * the other events and windowUpdate reads them, so between two waits they
+ * cost nothing but the events.
+ *
+ * WaitIdle returns once nothing was drawn for quiet ms, WaitChange once
+ * something was drawn that overlaps its region. Drawing that was reported
+ * but not read yet counts too, a WaitChange right after a click sees what
+ * the click did. Both poll() the connection in between and give up after
+ * the timeout. Without DAMAGE on the display they wait the timeout out on
+ * the timeline like a Delay, so --speed and --idle apply to it.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+struct DamageWatch {
+  bool ready;
+  bool present;         // false when the display has no DAMAGE
+  int event;            // the type of XDamageNotify
+  Damage damage;
+  long long last;       // monotonic ns of the last drawing
+  XRectangle region;    // what WaitChange looks at
+  bool changed;         // something was drawn over it
+};
+DamageWatch Painted = { false, false, 0, 0, 0, { 0, 0, 0, 0 }, false };
+
+static void damageInit(Display * dpy) {
+  int error;
+  Painted.ready = true;
+  Painted.present = XDamageQueryExtension(dpy, &Painted.event, &error);
+  if (!Painted.present) {
+    std::cerr << "No DAMAGE on this display, WaitIdle and WaitChange sleep instead" << std::endl;
+    return;
+  }
+  Painted.event += XDamageNotify;
+  // every rectangle as it is drawn, nothing to subtract afterwards
+  Painted.damage = XDamageCreate(dpy, RootWindow(dpy, DefaultScreen(dpy)), XDamageReportRawRectangles);
+  Painted.last = monotonicNow();
+  XFlush(dpy);
+}
+static void damageNotify(const XEvent &ev) {
+  const XDamageNotifyEvent &damage = (const XDamageNotifyEvent &)ev;
+  const XRectangle &a = damage.area, &r = Painted.region;
+  Painted.last = monotonicNow();
+  if (a.x < r.x + r.width && r.x < a.x + a.width && a.y < r.y + r.height && r.y < a.y + a.height) {
+    Painted.changed = true;
+  }
+}
+// true when it was quiet for quiet ms, or when the region changed, within
+// timeout ms
+static bool damageWait(Display * dpy, OpCode op, long quiet, long timeout) {
+  long long until = monotonicNow() + timeout * 1000000LL;
+  if (!Painted.ready) {
+    damageInit(dpy);
+  }
+  if (!Painted.present) {
+    timelineWait(timeout * 1000000LL);
+    return false;
+  }
+  flushEvents();
+  // only what is drawn from now on is quiet long enough
+  long long since = monotonicNow();
+  while (true) {
+    windowUpdate(dpy);
+    long long now = monotonicNow();
+    long long next = until;
+    if (op == OP_WAITCHANGE) {
+      if (Painted.changed) {
+        return true;
+      }
+    } else {
+      long long quietFrom = std::max(since, Painted.last) + quiet * 1000000LL;
+      if (now >= quietFrom) {
+        return true;
+      }
+      next = std::min(next, quietFrom);
+    }
+    if (now >= until) {
+      return false;
+    }
+    struct pollfd fd = { ConnectionNumber(dpy), POLLIN, 0 };
+    poll(&fd, 1, (int)((next - now + 999999) / 1000000));
+  }
+}
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * The window index. The first Focus or MoveWindow interns the atoms it needs
+ * in one request, selects PropertyNotify, CreateNotify and DestroyNotify on
+ * the root and reads _NET_CLIENT_LIST once, with the name, class and pid of
+ * every client. From then on the index follows the events: a new client
+ * list, a title that changes, a window that goes away. They are read while
+ * the timeline waits and before a lookup, which is no round trip at all
+ * when nothing changed. Without a window manager that keeps
+ * _NET_CLIENT_LIST the children of the root are indexed instead.
+ *
+ * A window is looked up by a part of its name, by class:PART of its class
+ * or instance name, or by pid:N.
+ *
+ * WaitForWindow, WaitForMap, WaitForFocus and WaitForClose poll() the
+ * connection until the events make what they wait for true, see windowWait.
+ * So the index also knows which windows are mapped and which one is active,
+ * from MapNotify, UnmapNotify, FocusIn and _NET_ACTIVE_WINDOW.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+enum WindowAtom {
+  WA_CLIENT_LIST,
+  WA_ACTIVE_WINDOW,
+  WA_NAME,
+  WA_UTF8,
+  WA_PID,
+  WA_COUNT
+};
+static const char * WindowAtomNames[WA_COUNT] = {
+  "_NET_CLIENT_LIST", "_NET_ACTIVE_WINDOW", "_NET_WM_NAME", "UTF8_STRING", "_NET_WM_PID"
+};
+struct WindowEntry {
+  std::string name;
+  std::string instance, wmclass;
+  unsigned long pid;
+  bool mapped;
+};
+struct WindowIndex {
+  bool ready;
+  bool ewmh;                    // the window manager keeps _NET_CLIENT_LIST
+  Atom atoms[WA_COUNT];
+  std::vector<Window> order;    // as the client list has them
+  std::unordered_map<Window,WindowEntry> entries;
+  Window active;                // the one with the focus
+};
+WindowIndex Windows = { false, false };
+bool WindowGone = false;
+int (*WindowErrorHandler)(Display *, XErrorEvent *) = NULL;
+
+// a window can go away any time, that is no reason to stop
+static int windowError(Display * dpy, XErrorEvent * ev) {
+  if (ev->error_code == BadWindow) {
+    WindowGone = true;
+    return 0;
+  }
+  return WindowErrorHandler(dpy, ev);
+}
+static bool windowProperty(Display * dpy, Window window, Atom atom, Atom type,
+                           unsigned char ** data, unsigned long &count) {
+  Atom actualType;
+  int format;
+  unsigned long bytesAfter;
+  *data = NULL;
+  if (XGetWindowProperty(dpy, window, atom, 0L, (~0L), False, type, &actualType,
+                         &format, &count, &bytesAfter, data) != Success || *data == NULL) {
+    count = 0;
+    return false;
+  }
+  return actualType != None;
+}
+// selects the events of a window and reads what it is looked up by
+static bool windowFetch(Display * dpy, Window window) {
+  WindowEntry entry;
+  XClassHint hint;
+  XWindowAttributes attr;
+  unsigned char * data;
+  unsigned long count;
+  char * name = NULL;
+  WindowGone = false;
+  WindowErrorHandler = XSetErrorHandler(windowError);
+  XSelectInput(dpy, window, PropertyChangeMask | StructureNotifyMask | FocusChangeMask);
+  entry.mapped = XGetWindowAttributes(dpy, window, &attr) && attr.map_state == IsViewable;
+  if (windowProperty(dpy, window, Windows.atoms[WA_NAME], Windows.atoms[WA_UTF8], &data, count)) {
+    entry.name.assign((char *)data, count);
+  } else if (XFetchName(dpy, window, &name) && name) {
+    entry.name = name;
+  }
+  if (data) XFree(data);
+  if (name) XFree(name);
+  if (XGetClassHint(dpy, window, &hint)) {
+    entry.instance = hint.res_name ? hint.res_name : "";
+    entry.wmclass = hint.res_class ? hint.res_class : "";
+    if (hint.res_name) XFree(hint.res_name);
+    if (hint.res_class) XFree(hint.res_class);
+  }
+  entry.pid = 0;
+  if (windowProperty(dpy, window, Windows.atoms[WA_PID], XA_CARDINAL, &data, count) && count) {
+    entry.pid = *(unsigned long *)data;
+  }
+  if (data) XFree(data);
+  XSetErrorHandler(WindowErrorHandler);
+  if (WindowGone) {
+    return false;
+  }
+  Windows.entries[window] = entry;
+  return true;
+}
+static void windowForget(Window window) {
+  Windows.entries.erase(window);
+  std::vector<Window>::iterator it = std::find(Windows.order.begin(), Windows.order.end(), window);
+  if (it != Windows.order.end()) {
+    Windows.order.erase(it);
+  }
+}
+// the clients, or the children of the root, after they changed
+static void windowClients(Display * dpy) {
+  Window root = RootWindow(dpy, DefaultScreen(dpy));
+  std::vector<Window> order;
+  unsigned char * data;
+  unsigned long count;
+  Windows.ewmh = windowProperty(dpy, root, Windows.atoms[WA_CLIENT_LIST], XA_WINDOW, &data, count);
+  if (Windows.ewmh) {
+    order.assign((Window *)data, (Window *)data + count);
+  } else {
+    Window rootReturn, parent, * children = NULL;
+    unsigned int n = 0;
+    if (XQueryTree(dpy, root, &rootReturn, &parent, &children, &n) && children) {
+      order.assign(children, children + n);
+      XFree(children);
+    }
+  }
+  if (data) XFree(data);
+  std::unordered_map<Window,WindowEntry> entries;
+  entries.swap(Windows.entries);
+  Windows.order.clear();
+  for (size_t i = 0; i < order.size(); i++) {
+    std::unordered_map<Window,WindowEntry>::iterator it = entries.find(order[i]);
+    if (it != entries.end()) {
+      Windows.entries[order[i]] = it->second;
+      Windows.order.push_back(order[i]);
+    } else if (windowFetch(dpy, order[i])) {
+      Windows.order.push_back(order[i]);
+    }
+  }
+}
+static void windowActive(Display * dpy) {
+  Window root = RootWindow(dpy, DefaultScreen(dpy));
+  unsigned char * data;
+  unsigned long count;
+  int revert;
+  if (windowProperty(dpy, root, Windows.atoms[WA_ACTIVE_WINDOW], XA_WINDOW, &data, count) && count) {
+    Windows.active = *(Window *)data;
+  } else {
+    XGetInputFocus(dpy, &Windows.active, &revert);
+  }
+  if (data) XFree(data);
+}
+static void windowIndexInit(Display * dpy) {
+  Window root = RootWindow(dpy, DefaultScreen(dpy));
+  XInternAtoms(dpy, (char **)WindowAtomNames, WA_COUNT, False, Windows.atoms);
+  XSelectInput(dpy, root, PropertyChangeMask | SubstructureNotifyMask);
+  windowClients(dpy);
+  windowActive(dpy);
+  Windows.ready = true;
+}
+// every event that came in, the MappingNotify keymapCheck looks for too
+static void windowUpdate(Display * dpy) {
+  XEvent ev;
+  // only looks at what has come in, this doesn't wait for the server
+  if ((!Windows.ready && !Painted.ready) || XEventsQueued(dpy, QueuedAfterReading) == 0) {
+    return;
+  }
+  Window root = RootWindow(dpy, DefaultScreen(dpy));
+  bool clients = false;
+  while (XEventsQueued(dpy, QueuedAlready) > 0) {
+    XNextEvent(dpy, &ev);
+    std::unordered_map<Window,WindowEntry>::iterator it = Windows.entries.find(ev.xany.window);
+    switch (ev.type) {
+      case CreateNotify:
+        if (!Windows.ewmh && ev.xcreatewindow.parent == root &&
+            windowFetch(dpy, ev.xcreatewindow.window)) {
+          Windows.order.push_back(ev.xcreatewindow.window);
+        }
+        break;
+      case DestroyNotify:
+        windowForget(ev.xdestroywindow.window);
+        break;
+      case MapNotify:
+      case UnmapNotify:
+        if (it != Windows.entries.end() && ev.xany.window == ev.xmap.window) {
+          it->second.mapped = ev.type == MapNotify;
+        }
+        break;
+      case FocusIn:
+        if (it != Windows.entries.end() && ev.xfocus.mode != NotifyGrab) {
+          Windows.active = ev.xfocus.window;
+        }
+        break;
+      case PropertyNotify:
+        if (ev.xproperty.window == root) {
+          clients = clients || ev.xproperty.atom == Windows.atoms[WA_CLIENT_LIST];
+          if (ev.xproperty.atom == Windows.atoms[WA_ACTIVE_WINDOW]) {
+            windowActive(dpy);
+          }
+        } else if (it != Windows.entries.end() &&
+                   (ev.xproperty.atom == XA_WM_NAME || ev.xproperty.atom == Windows.atoms[WA_NAME] ||
+                    ev.xproperty.atom == XA_WM_CLASS || ev.xproperty.atom == Windows.atoms[WA_PID]) &&
+                   !windowFetch(dpy, ev.xproperty.window)) {
+          windowForget(ev.xproperty.window);
+        }
+        break;
+      case MappingNotify:
+        XRefreshKeyboardMapping(&ev.xmapping);
+        if (ev.xmapping.request != MappingPointer) {
+          Keymap.valid = false;
+        }
+        break;
+      default:
+        if (Painted.present && ev.type == Painted.event) {
+          damageNotify(ev);
+        }
+        // the rest of what StructureNotify brings, nobody needs it
+        break;
+    }
+  }
+  if (clients) {
+    windowClients(dpy);
+  }
+}
+// the windows key matches, in the order of the client list
+static void windowFind(Display * dpy, const std::string &key, std::vector<Window> &found) {
+  if (!Windows.ready) {
+    windowIndexInit(dpy);
+  }
+  windowUpdate(dpy);
+  found.clear();
+  unsigned long pid = 0;
+  bool byPid = key.compare(0, 4, "pid:") == 0;
+  bool byClass = key.compare(0, 6, "class:") == 0;
+  std::string part = byClass ? key.substr(6) : key;
+  if (byPid) {
+    pid = strtoul(key.c_str() + 4, NULL, 10);
+  }
+  for (size_t i = 0; i < Windows.order.size(); i++) {
+    const WindowEntry &entry = Windows.entries[Windows.order[i]];
+    if (byPid ? entry.pid == pid :
+        byClass ? entry.wmclass.find(part) != std::string::npos ||
+                  entry.instance.find(part) != std::string::npos :
+        entry.name.find(part) != std::string::npos) {
+      found.push_back(Windows.order[i]);
+    }
+  }
+}
+// whether what a WaitFor... waits for is there
+static bool windowState(Display * dpy, OpCode op, const std::string &key) {
+  std::vector<Window> found;
+  windowFind(dpy, key, found);
+  for (size_t i = 0; i < found.size(); i++) {
+    if (op == OP_WAITFORWINDOW ||
+        (op == OP_WAITFORMAP && Windows.entries[found[i]].mapped) ||
+        (op == OP_WAITFORFOCUS && Windows.active == found[i])) {
+      return true;
+    }
+  }
+  return op == OP_WAITFORCLOSE && found.empty();
+}
+// true when it happened within timeout ms
+static bool windowWait(Display * dpy, OpCode op, const std::string &key, long timeout) {
+  long long until = monotonicNow() + timeout * 1000000LL;
+  flushEvents();
+  while (!windowState(dpy, op, key)) {
+    long long left = until - monotonicNow();
+    if (left <= 0) {
+      return false;
+    }
+    // sleeps until the server has something to say
+    struct pollfd fd = { ConnectionNumber(dpy), POLLIN, 0 };
+    poll(&fd, 1, (int)((left + 999999) / 1000000));
+  }
+  return true;
+}
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Screen capture for PixelHash and GetPixel. With MIT-SHM the first capture
+ * makes a shared memory image the size of the screen and keeps it, the
+ * server copies a region straight into it and no pixels go over the
+ * connection. Without it (a display on another machine) every capture is
+ * an XGetImage.
+ *
+ * With --fb the screen is read from the file Xvfb -fbdir keeps it in, an
+ * XWD file the server draws into. It is mapped once and a capture is just
+ * a view into it, no request goes to the server. The colormap of an 8 bit
+ * screen is in the file too and gives GetPixel its colours.
+ *
+ * On a screen with a colormap, like the 8 bit one of run startvfb, a pixel
+ * is only an index. Every capture then reads the colormap too with
+ * XQueryColors, GetPixel gives the colour and PixelHash hashes the colours,
+ * so a changed colormap changes the hash.
+ *
+ * A region is hashed with CRC32C, every row on its own and then the CRCs of
+ * the rows. With SSE4.2 four rows go through the crc32 instruction side by
+ * side, the table gives the same numbers on any other CPU.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+struct Capture {
+  bool ready;
+  bool shm;
+  XImage * image;               // the last capture
+  XShmSegmentInfo segment;
+  int width, height;            // of the screen
+  bool fb;                      // a view into Framebuffer
+  XImage view;
+  std::vector<unsigned char> palette;   // r, g, b of every pixel value of a
+                                        // visual without masks
+};
+Capture Shot = { false, false, NULL };
+bool CaptureFailed = false;
+uint32_t Crc32cTable[256];
+
+struct Framebuffer {
+  const unsigned char * map;
+  size_t size;
+  const unsigned char * colors; // XWDColor, big endian like the header
+  unsigned long ncolors;
+  XImage format;                // data points at the first pixel
+};
+Framebuffer Fb = { NULL, 0, NULL, 0 };
+
+static inline unsigned long fbNumber(const unsigned char * p) {
+  return (unsigned long)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+// maps the XWD file of Xvfb -fbdir, false when it isn't one
+static bool fbOpen(const char * name) {
+  struct stat st;
+  int fd = open(name, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sz_XWDheader) {
+    std::cerr << "Could not open " << name << ": " << strerror(errno) << std::endl;
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  void * map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    std::cerr << "Could not map " << name << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  // the header is 25 numbers, always big endian
+  const unsigned char * h = (const unsigned char *)map;
+  unsigned long header[sz_XWDheader / 4];
+  for (int i = 0; i < sz_XWDheader / 4; i++) {
+    header[i] = fbNumber(h + i * 4);
+  }
+  XWDFileHeader xwd;
+  xwd.header_size = header[0];
+  xwd.file_version = header[1];
+  xwd.pixmap_format = header[2];
+  xwd.pixmap_depth = header[3];
+  xwd.pixmap_width = header[4];
+  xwd.pixmap_height = header[5];
+  xwd.byte_order = header[7];
+  xwd.bitmap_unit = header[8];
+  xwd.bitmap_bit_order = header[9];
+  xwd.bitmap_pad = header[10];
+  xwd.bits_per_pixel = header[11];
+  xwd.bytes_per_line = header[12];
+  xwd.red_mask = header[14];
+  xwd.green_mask = header[15];
+  xwd.blue_mask = header[16];
+  xwd.ncolors = header[19];
+  size_t pixels = (size_t)xwd.header_size + (size_t)xwd.ncolors * sz_XWDColor;
+  if (xwd.file_version != XWD_FILE_VERSION || xwd.pixmap_format != ZPixmap ||
+      (xwd.bits_per_pixel != 8 && xwd.bits_per_pixel != 16 && xwd.bits_per_pixel != 32) ||
+      xwd.header_size < sz_XWDheader ||
+      pixels + (size_t)xwd.bytes_per_line * xwd.pixmap_height > (size_t)st.st_size) {
+    std::cerr << name << " is not a framebuffer Xvfb -fbdir writes" << std::endl;
+    munmap(map, st.st_size);
+    return false;
+  }
+  Fb.map = h;
+  Fb.size = st.st_size;
+  Fb.colors = h + xwd.header_size;
+  Fb.ncolors = xwd.ncolors;
+  XImage &image = Fb.format;
+  memset(&image, 0, sizeof(image));
+  image.width = xwd.pixmap_width;
+  image.height = xwd.pixmap_height;
+  image.format = ZPixmap;
+  image.data = (char *)h + pixels;
+  image.byte_order = xwd.byte_order;
+  image.bitmap_unit = xwd.bitmap_unit;
+  image.bitmap_bit_order = xwd.bitmap_bit_order;
+  image.bitmap_pad = xwd.bitmap_pad;
+  image.depth = xwd.pixmap_depth;
+  image.bytes_per_line = xwd.bytes_per_line;
+  image.bits_per_pixel = xwd.bits_per_pixel;
+  image.red_mask = xwd.red_mask;
+  image.green_mask = xwd.green_mask;
+  image.blue_mask = xwd.blue_mask;
+  return XInitImage(&image) != 0;
+}
+// the colour of a pixel of an 8 bit screen, from the colormap in the file
+static bool fbColor(unsigned long pixel, int rgb[3]) {
+  const unsigned char * c = Fb.colors + pixel * sz_XWDColor;
+  if (pixel >= Fb.ncolors || fbNumber(c) != pixel) {
+    // Xvfb keeps them in order, anything else has to be looked for
+    for (c = Fb.colors; c < Fb.colors + Fb.ncolors * sz_XWDColor; c += sz_XWDColor) {
+      if (fbNumber(c) == pixel) {
+        break;
+      }
+    }
+    if (c == Fb.colors + Fb.ncolors * sz_XWDColor) {
+      return false;
+    }
+  }
+  for (int i = 0; i < 3; i++) {
+    rgb[i] = c[4 + i * 2];
+  }
+  return true;
+}
+
+static int captureError(Display *, XErrorEvent *) {
+  CaptureFailed = true;
+  return 0;
+}
+static void captureInit(Display * dpy, Capture &shot) {
+  int screen = DefaultScreen(dpy);
+  shot.ready = true;
+  shot.width = DisplayWidth(dpy, screen);
+  shot.height = DisplayHeight(dpy, screen);
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+    }
+    Crc32cTable[i] = c;
+  }
+  if (Fb.map != NULL) {
+    shot.fb = Fb.format.width == shot.width && Fb.format.height == shot.height;
+    if (shot.fb) {
+      return;
+    }
+    std::cerr << FramebufferName << " is " << Fb.format.width << "x" << Fb.format.height
+              << ", the screen " << shot.width << "x" << shot.height << ", it isn't used" << std::endl;
+    munmap((void *)Fb.map, Fb.size);
+    Fb.map = NULL;
+  }
+  if (!XShmQueryExtension(dpy)) {
+    return;
+  }
+  shot.image = XShmCreateImage(dpy, DefaultVisual(dpy, screen), DefaultDepth(dpy, screen),
+                               ZPixmap, NULL, &shot.segment, shot.width, shot.height);
+  if (shot.image == NULL) {
+    return;
+  }
+  shot.segment.shmid = shmget(IPC_PRIVATE, shot.image->bytes_per_line * shot.image->height,
+                              IPC_CREAT | 0600);
+  shot.segment.shmaddr = shot.image->data =
+    shot.segment.shmid < 0 ? (char *)-1 : (char *)shmat(shot.segment.shmid, NULL, 0);
+  shot.segment.readOnly = False;
+  if (shot.image->data != (char *)-1) {
+    // a server on another machine can't attach it, that comes back as an error
+    int (*previous)(Display *, XErrorEvent *) = XSetErrorHandler(captureError);
+    CaptureFailed = false;
+    XShmAttach(dpy, &shot.segment);
+    XSync(dpy, False);
+    XSetErrorHandler(previous);
+    shot.shm = !CaptureFailed;
+  }
+  if (shot.segment.shmid >= 0) {
+    // it goes away with the last process that has it attached
+    shmctl(shot.segment.shmid, IPC_RMID, NULL);
+  }
+  if (!shot.shm) {
+    if (shot.image->data != (char *)-1) {
+      shmdt(shot.image->data);
+    }
+    shot.image->data = NULL;
+    XDestroyImage(shot.image);
+    shot.image = NULL;
+  }
+}
+// clips the region to the screen, false when nothing is left of it
+static bool captureClip(int &x, int &y, int &w, int &h) {
+  if (x < 0) { w += x; x = 0; }
+  if (y < 0) { h += y; y = 0; }
+  if (x + w > Shot.width) w = Shot.width - x;
+  if (y + h > Shot.height) h = Shot.height - y;
+  return w > 0 && h > 0;
+}
+static XImage * captureGrab(Display * dpy, Capture &shot, int x, int y, int w, int h) {
+  Window root = RootWindow(dpy, DefaultScreen(dpy));
+  if (shot.fb) {
+    // the region starts inside the rows of the whole screen
+    shot.view = Fb.format;
+    shot.view.width = w;
+    shot.view.height = h;
+    shot.view.data += (size_t)y * Fb.format.bytes_per_line + x * Fb.format.bits_per_pixel / 8;
+    return &shot.view;
+  }
+  if (shot.shm) {
+    // the rows of the region are packed at the top of the segment
+    XImage * image = shot.image;
+    image->width = w;
+    image->height = h;
+    image->bytes_per_line = (w * image->bits_per_pixel + image->bitmap_pad - 1) /
+                            image->bitmap_pad * (image->bitmap_pad / 8);
+    return XShmGetImage(dpy, root, image, x, y, AllPlanes) ? image : NULL;
+  }
+  if (shot.image) {
+    XDestroyImage(shot.image);
+  }
+  shot.image = XGetImage(dpy, root, x, y, w, h, AllPlanes, ZPixmap);
+  return shot.image;
+}
+// reads the colormap of a screen that has one, a visual with masks doesn't
+static void capturePalette(Display * dpy, Capture &shot) {
+  int screen = DefaultScreen(dpy);
+  Visual * visual = DefaultVisual(dpy, screen);
+  if (shot.fb || visual->red_mask != 0 || visual->map_entries <= 0) {
+    shot.palette.clear();
+    return;
+  }
+  std::vector<XColor> colors(visual->map_entries);
+  for (size_t i = 0; i < colors.size(); i++) {
+    colors[i].pixel = i;
+  }
+  XQueryColors(dpy, DefaultColormap(dpy, screen), &colors[0], colors.size());
+  shot.palette.resize(colors.size() * 3);
+  for (size_t i = 0; i < colors.size(); i++) {
+    shot.palette[i * 3] = colors[i].red >> 8;
+    shot.palette[i * 3 + 1] = colors[i].green >> 8;
+    shot.palette[i * 3 + 2] = colors[i].blue >> 8;
+  }
+}
+static XImage * captureRegion(Display * dpy, int x, int y, int w, int h) {
+  // the screen should show what was sent before
+  flushEvents();
+  if (Shot.fb) {
+    // reading the framebuffer is no request, the round trip makes sure
+    // the server has played the events before it is read
+    XSync(dpy, False);
+  }
+  capturePalette(dpy, Shot);
+  return captureGrab(dpy, Shot, x, y, w, h);
+}
+static inline uint32_t crc32cBytes(uint32_t crc, const unsigned char * p, size_t n) {
+  while (n--) {
+    crc = Crc32cTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static void crc32cRows(const XImage * image, size_t length, uint32_t * rows) {
+  int y = 0;
+  for (; y + 4 <= image->height; y += 4) {
+    const unsigned char * p[4];
+    unsigned long long c[4];
+    for (int k = 0; k < 4; k++) {
+      p[k] = (const unsigned char *)image->data + (y + k) * image->bytes_per_line;
+      c[k] = 0xffffffff;
+    }
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+      unsigned long long v[4];
+      for (int k = 0; k < 4; k++) {
+        memcpy(&v[k], p[k] + i, 8);
+      }
+      c[0] = _mm_crc32_u64(c[0], v[0]);
+      c[1] = _mm_crc32_u64(c[1], v[1]);
+      c[2] = _mm_crc32_u64(c[2], v[2]);
+      c[3] = _mm_crc32_u64(c[3], v[3]);
+    }
+    for (int k = 0; k < 4; k++) {
+      rows[y + k] = ~crc32cBytes((uint32_t)c[k], p[k] + i, length - i);
+    }
+  }
+  for (; y < image->height; y++) {
+    const unsigned char * p = (const unsigned char *)image->data + y * image->bytes_per_line;
+    unsigned long long c = 0xffffffff;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+      unsigned long long v;
+      memcpy(&v, p + i, 8);
+      c = _mm_crc32_u64(c, v);
+    }
+    rows[y] = ~crc32cBytes((uint32_t)c, p + i, length - i);
+  }
+}
+#endif
+static void captureRgb(const Capture &shot, XImage * image, int x, int y, int rgb[3]);
+// whether the pixels are indexes into a colormap
+static inline bool captureIndexed(const Capture &shot, const XImage * image) {
+  return image->red_mask == 0 && (shot.fb ? Fb.colors != NULL : !shot.palette.empty());
+}
+// the CRC32C of every row, then of the rows' CRCs
+static uint32_t captureHash(const Capture &shot, XImage * image) {
+  size_t length = (size_t)image->width * image->bits_per_pixel / 8;
+  std::vector<uint32_t> rows(image->height);
+#if defined(__x86_64__)
+  static const bool sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+  if (captureIndexed(shot, image)) {
+    // the colours, the indexes may stand for others tomorrow
+    std::vector<unsigned char> colors(image->width * 3);
+    for (int y = 0; y < image->height; y++) {
+      for (int x = 0; x < image->width; x++) {
+        int rgb[3];
+        captureRgb(shot, image, x, y, rgb);
+        colors[x * 3] = rgb[0];
+        colors[x * 3 + 1] = rgb[1];
+        colors[x * 3 + 2] = rgb[2];
+      }
+      rows[y] = ~crc32cBytes(0xffffffff, &colors[0], colors.size());
+    }
+  } else
+#if defined(__x86_64__)
+  if (sse42) {
+    crc32cRows(image, length, &rows[0]);
+  } else
+#endif
+  for (int y = 0; y < image->height; y++) {
+    rows[y] = ~crc32cBytes(0xffffffff, (const unsigned char *)image->data +
+                           y * image->bytes_per_line, length);
+  }
+  unsigned char bytes[4];
+  uint32_t crc = 0xffffffff;
+  for (int y = 0; y < image->height; y++) {
+    for (int k = 0; k < 4; k++) {
+      bytes[k] = rows[y] >> (k * 8);
+    }
+    crc = crc32cBytes(crc, bytes, 4);
+  }
+  return ~crc;
+}
+// the red, green and blue of a pixel, from the masks of the visual or the
+// colormap
+static void captureRgb(const Capture &shot, XImage * image, int x, int y, int rgb[3]) {
+  unsigned long pixel = XGetPixel(image, x, y);
+  unsigned long masks[3] = { image->red_mask, image->green_mask, image->blue_mask };
+  if (image->red_mask == 0) {
+    if (shot.fb && Fb.colors != NULL && fbColor(pixel, rgb)) {
+      return;
+    }
+    if (!shot.fb && pixel < shot.palette.size() / 3) {
+      for (int i = 0; i < 3; i++) {
+        rgb[i] = shot.palette[pixel * 3 + i];
+      }
+      return;
+    }
+  }
+  for (int i = 0; i < 3; i++) {
+    unsigned long mask = masks[i];
+    unsigned long v = pixel & mask;
+    int bits = 0;
+    if (mask == 0) {
+      rgb[i] = 0;
+      continue;
+    }
+    while (!(mask & 1)) {
+      mask >>= 1;
+      v >>= 1;
+    }
+    while (mask & 1) {
+      mask >>= 1;
+      bits++;
+    }
+    rgb[i] = bits >= 8 ? v >> (bits - 8) : v * 255 / ((1UL << bits) - 1);
+  }
+}
+// a pixel as #rrggbb
+static std::string capturePixel(const Capture &shot, XImage * image, int x, int y) {
+  char text[8];
+  int rgb[3];
+  captureRgb(shot, image, x, y, rgb);
+  snprintf(text, sizeof(text), "#%02x%02x%02x", rgb[0], rgb[1], rgb[2]);
+  return text;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * FindImage looks for a PNG on the screen by normalized cross-correlation of
+ * the grey levels, which doesn't care if the screen is a bit brighter or
+ * darker than the picture. Both go down an image pyramid, halved until the
+ * picture is about 12 pixels across. At the top all of the region is
+ * searched, its rows split over the threads of the pool, and the best few
+ * spots are followed down, each level only looking 2 pixels around where the
+ * one above pointed. A search is a full scan of the smallest level and a
+ * handful of 5x5 neighbourhoods below, so it takes about as long wherever
+ * the picture is, or whether it is there at all.
+ *
+ * The window sums come from integral images, the products of the picture
+ * and the screen are added up 8 pixels at a time with SSE2.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#define _FIND_MIN_SIZE   12     // the top of the pyramid is at least this big
+#define _FIND_CANDIDATES 8      // spots followed down from the top
+#define _FIND_REACH      2      // how far a level looks around the spot
+
+struct GrayImage {
+  int width, height;
+  std::vector<unsigned char> pixels;
+};
+// a level of the pyramid of the screen, with its integral images
+struct GrayLevel {
+  GrayImage image;
+  std::vector<long long> sum, sqsum;    // (width + 1) x (height + 1)
+};
+// a level of the pyramid of a picture
+struct NeedleLevel {
+  GrayImage image;
+  double sum, spread;                   // sum of T and of (T - mean)^2
+};
+std::map<std::string,std::vector<NeedleLevel> > Needles;
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * The pool runs a job over a range of rows on every CPU, the calling thread
+ * takes part too. The threads are started the first time and stay until the
+ * pool is destroyed at exit, which wakes and joins them.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+class WorkPool {
+  public:
+    WorkPool() : p_started(false), p_stop(false), p_generation(0), p_busy(0) {}
+    ~WorkPool() {
+      {
+        std::lock_guard<std::mutex> lock(p_mutex);
+        p_stop = true;
+      }
+      p_wake.notify_all();
+      for (size_t i = 0; i < p_workers.size(); i++) {
+        p_workers[i].join();
+      }
+    }
+    void Run(int count, const std::function<void(int,int)> &job) {
+      start();
+      std::unique_lock<std::mutex> lock(p_mutex);
+      p_job = &job;
+      p_count = count;
+      p_next = 0;
+      p_busy = p_threads;
+      p_generation++;
+      p_wake.notify_all();
+      lock.unlock();
+      work();
+      lock.lock();
+      while (p_busy > 0) {
+        p_done.wait(lock);
+      }
+      p_job = NULL;
+    }
+  private:
+    void start() {
+      if (p_started) {
+        return;
+      }
+      p_started = true;
+      p_threads = std::thread::hardware_concurrency();
+      p_threads = p_threads > 1 ? p_threads - 1 : 0;
+      for (int i = 0; i < p_threads; i++) {
+        p_workers.push_back(std::thread(&WorkPool::loop, this));
+      }
+    }
+    void loop() {
+      unsigned long seen = 0;
+      std::unique_lock<std::mutex> lock(p_mutex);
+      while (true) {
+        while (p_generation == seen && !p_stop) {
+          p_wake.wait(lock);
+        }
+        if (p_stop) {
+          return;
+        }
+        seen = p_generation;
+        lock.unlock();
+        work();
+        lock.lock();
+        if (--p_busy == 0) {
+          p_done.notify_one();
+        }
+      }
+    }
+    // takes 8 rows at a time until they are all done
+    void work() {
+      while (true) {
+        int first, last;
+        {
+          std::lock_guard<std::mutex> lock(p_mutex);
+          if (p_job == NULL || p_next >= p_count) {
+            return;
+          }
+          first = p_next;
+          last = std::min(p_count, first + 8);
+          p_next = last;
+        }
+        (*p_job)(first, last);
+      }
+    }
+    bool p_started, p_stop;
+    int p_threads;
+    std::vector<std::thread> p_workers;
+    unsigned long p_generation;
+    int p_busy;
+    const std::function<void(int,int)> * p_job;
+    int p_count, p_next;
+    std::mutex p_mutex;
+    std::condition_variable p_wake, p_done;
+};
+WorkPool FindPool;
+
+static void grayHalf(const GrayImage &from, GrayImage &to) {
+  to.width = from.width / 2;
+  to.height = from.height / 2;
+  to.pixels.resize(to.width * to.height);
+  for (int y = 0; y < to.height; y++) {
+    const unsigned char * a = &from.pixels[2 * y * from.width];
+    const unsigned char * b = a + from.width;
+    for (int x = 0; x < to.width; x++) {
+      to.pixels[y * to.width + x] = (a[2 * x] + a[2 * x + 1] + b[2 * x] + b[2 * x + 1] + 2) / 4;
+    }
+  }
+}
+static void grayFromImage(const Capture &shot, XImage * image, GrayImage &gray) {
+  gray.width = image->width;
+  gray.height = image->height;
+  gray.pixels.resize(gray.width * gray.height);
+  bool rgb32 = image->bits_per_pixel == 32 && image->red_mask == 0xff0000 &&
+               image->green_mask == 0xff00 && image->blue_mask == 0xff &&
+               image->byte_order == LSBFirst;
+  for (int y = 0; y < gray.height; y++) {
+    unsigned char * out = &gray.pixels[y * gray.width];
+    if (rgb32) {
+      // the usual TrueColor screen, read it straight from the bytes
+      const unsigned char * p = (const unsigned char *)image->data + y * image->bytes_per_line;
+      for (int x = 0; x < gray.width; x++, p += 4) {
+        out[x] = (p[2] * 77 + p[1] * 150 + p[0] * 29) >> 8;
+      }
+    } else {
+      for (int x = 0; x < gray.width; x++) {
+        int rgb[3];
+        captureRgb(shot, image, x, y, rgb);
+        out[x] = (rgb[0] * 77 + rgb[1] * 150 + rgb[2] * 29) >> 8;
+      }
+    }
+  }
+}
+static void grayLevel(GrayLevel &level) {
+  int w = level.image.width, h = level.image.height;
+  level.sum.assign((w + 1) * (h + 1), 0);
+  level.sqsum.assign((w + 1) * (h + 1), 0);
+  for (int y = 0; y < h; y++) {
+    long long row = 0, sqrow = 0;
+    for (int x = 0; x < w; x++) {
+      long long v = level.image.pixels[y * w + x];
+      row += v;
+      sqrow += v * v;
+      level.sum[(y + 1) * (w + 1) + x + 1] = level.sum[y * (w + 1) + x + 1] + row;
+      level.sqsum[(y + 1) * (w + 1) + x + 1] = level.sqsum[y * (w + 1) + x + 1] + sqrow;
+    }
+  }
+}
+static inline long long windowSum(const std::vector<long long> &s, int stride,
+                                  int x, int y, int w, int h) {
+  return s[(y + h) * stride + x + w] - s[y * stride + x + w] - s[(y + h) * stride + x] + s[y * stride + x];
+}
+// the sum of the products of the picture and the screen under it
+static inline long long windowDot(const GrayImage &screen, const GrayImage &t, int x, int y) {
+  long long total = 0;
+#if defined(__x86_64__)
+  // the products of a row are added in 32 bits, the rows in 64
+  __m128i zero = _mm_setzero_si128();
+  __m128i all = zero;
+  int wide = t.width & ~7;
+  for (int r = 0; r < t.height; r++) {
+    const unsigned char * a = &screen.pixels[(y + r) * screen.width + x];
+    const unsigned char * b = &t.pixels[r * t.width];
+    __m128i acc = zero;
+    for (int i = 0; i < wide; i += 8) {
+      __m128i va = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(a + i)), zero);
+      __m128i vb = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(b + i)), zero);
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(va, vb));
+    }
+    all = _mm_add_epi64(all, _mm_add_epi64(_mm_unpacklo_epi32(acc, zero), _mm_unpackhi_epi32(acc, zero)));
+    for (int i = wide; i < t.width; i++) {
+      total += a[i] * b[i];
+    }
+  }
+  long long lanes[2];
+  _mm_storeu_si128((__m128i *)lanes, all);
+  total += lanes[0] + lanes[1];
+#else
+  for (int r = 0; r < t.height; r++) {
+    const unsigned char * a = &screen.pixels[(y + r) * screen.width + x];
+    const unsigned char * b = &t.pixels[r * t.width];
+    for (int i = 0; i < t.width; i++) {
+      total += a[i] * b[i];
+    }
+  }
+#endif
+  return total;
+}
+// the correlation of the picture with the screen at x y, -1 to 1
+static double findScore(const GrayLevel &screen, const NeedleLevel &needle, int x, int y) {
+  const GrayImage &t = needle.image;
+  int stride = screen.image.width + 1;
+  double n = (double)t.width * t.height;
+  double dot = windowDot(screen.image, t, x, y);
+  double sum = windowSum(screen.sum, stride, x, y, t.width, t.height);
+  double spread = windowSum(screen.sqsum, stride, x, y, t.width, t.height) - sum * sum / n;
+  if (spread <= 0 || needle.spread <= 0) {
+    // a flat area or a flat picture, only equal is a match
+    return spread <= 0 && needle.spread <= 0 && fabs(sum - needle.sum) < n ? 1 : 0;
+  }
+  return (dot - sum * needle.sum / n) / sqrt(spread * needle.spread);
+}
+static bool loadNeedle(const std::string &name, std::vector<NeedleLevel> &levels) {
+  png_image png;
+  memset(&png, 0, sizeof(png));
+  png.version = PNG_IMAGE_VERSION;
+  if (!png_image_begin_read_from_file(&png, name.c_str())) {
+    std::cerr << "Could not read " << name << ": " << png.message << std::endl;
+    return false;
+  }
+  // libpng's own grey is gamma corrected, the picture has to come out the
+  // same grey as the screen
+  png.format = PNG_FORMAT_RGB;
+  std::vector<unsigned char> rgb(PNG_IMAGE_SIZE(png));
+  if (!png_image_finish_read(&png, NULL, &rgb[0], 0, NULL)) {
+    std::cerr << "Could not read " << name << ": " << png.message << std::endl;
+    return false;
+  }
+  NeedleLevel level;
+  level.image.width = png.width;
+  level.image.height = png.height;
+  level.image.pixels.resize(png.width * png.height);
+  for (size_t i = 0; i < level.image.pixels.size(); i++) {
+    level.image.pixels[i] = (rgb[3 * i] * 77 + rgb[3 * i + 1] * 150 + rgb[3 * i + 2] * 29) >> 8;
+  }
+  levels.clear();
+  levels.push_back(level);
+  while (levels.back().image.width / 2 >= _FIND_MIN_SIZE && levels.back().image.height / 2 >= _FIND_MIN_SIZE) {
+    levels.push_back(NeedleLevel());
+    grayHalf(levels[levels.size() - 2].image, levels.back().image);
+  }
+  for (size_t i = 0; i < levels.size(); i++) {
+    const std::vector<unsigned char> &p = levels[i].image.pixels;
+    double sum = 0, sq = 0;
+    for (size_t k = 0; k < p.size(); k++) {
+      sum += p[k];
+      sq += (double)p[k] * p[k];
+    }
+    levels[i].sum = sum;
+    levels[i].spread = sq - sum * sum / p.size();
+  }
+  return true;
+}
+struct FindSpot {
+  int x, y;
+  double score;
+};
+static inline bool betterSpot(const FindSpot &a, const FindSpot &b) {
+  return a.score > b.score;
+}
+// the best spot of the picture in the region, its top left corner and score
+static bool findImage(Display * dpy, const std::string &name, int x, int y, int w, int h,
+                      FindSpot &found) {
+  std::map<std::string,std::vector<NeedleLevel> >::iterator it = Needles.find(name);
+  if (it == Needles.end()) {
+    it = Needles.insert(std::make_pair(name, std::vector<NeedleLevel>())).first;
+    if (!loadNeedle(name, it->second)) {
+      Needles.erase(it);
+      return false;
+    }
+  }
+  const std::vector<NeedleLevel> &needle = it->second;
+  XImage * image;
+  if (!Shot.ready) {
+    captureInit(dpy, Shot);
+  }
+  if (!captureClip(x, y, w, h) || w < needle[0].image.width || h < needle[0].image.height ||
+      !(image = captureRegion(dpy, x, y, w, h))) {
+    return false;
+  }
+  // the screen gets as many levels as the picture, if it is big enough
+  std::vector<GrayLevel> screen(1);
+  grayFromImage(Shot, image, screen[0].image);
+  while (screen.size() < needle.size() &&
+         screen.back().image.width / 2 >= needle[screen.size()].image.width &&
+         screen.back().image.height / 2 >= needle[screen.size()].image.height) {
+    screen.push_back(GrayLevel());
+    grayHalf(screen[screen.size() - 2].image, screen.back().image);
+  }
+  for (size_t i = 0; i < screen.size(); i++) {
+    grayLevel(screen[i]);
+  }
+
+  // every spot of the top level, a row at a time on the pool
+  int top = screen.size() - 1;
+  const GrayLevel &level = screen[top];
+  const NeedleLevel &pic = needle[top];
+  int cols = level.image.width - pic.image.width + 1;
+  int rows = level.image.height - pic.image.height + 1;
+  std::vector<FindSpot> best(rows);
+  std::function<void(int,int)> scan = [&](int first, int last) {
+    for (int sy = first; sy < last; sy++) {
+      FindSpot spot = { 0, sy, -2 };
+      for (int sx = 0; sx < cols; sx++) {
+        double score = findScore(level, pic, sx, sy);
+        if (score > spot.score) {
+          spot.x = sx;
+          spot.score = score;
+        }
+      }
+      best[sy] = spot;
+    }
+  };
+  FindPool.Run(rows, scan);
+  std::sort(best.begin(), best.end(), betterSpot);
+  // the best rows that aren't the same place again
+  std::vector<FindSpot> spots;
+  for (size_t i = 0; i < best.size() && spots.size() < _FIND_CANDIDATES; i++) {
+    bool near = false;
+    for (size_t k = 0; k < spots.size() && !near; k++) {
+      near = abs(spots[k].x - best[i].x) < pic.image.width / 2 &&
+             abs(spots[k].y - best[i].y) < pic.image.height / 2;
+    }
+    if (!near) {
+      spots.push_back(best[i]);
+    }
+  }
+
+  // follow them down to the screen itself
+  for (int l = top - 1; l >= 0; l--) {
+    const GrayLevel &below = screen[l];
+    const NeedleLevel &p = needle[l];
+    int maxx = below.image.width - p.image.width, maxy = below.image.height - p.image.height;
+    for (size_t i = 0; i < spots.size(); i++) {
+      FindSpot at = spots[i];
+      spots[i].score = -2;
+      for (int dy = -_FIND_REACH; dy <= _FIND_REACH; dy++) {
+        for (int dx = -_FIND_REACH; dx <= _FIND_REACH; dx++) {
+          int sx = at.x * 2 + dx, sy = at.y * 2 + dy;
+          if (sx < 0 || sy < 0 || sx > maxx || sy > maxy) {
+            continue;
+          }
+          double score = findScore(below, p, sx, sy);
+          if (score > spots[i].score) {
+            spots[i].x = sx;
+            spots[i].y = sy;
+            spots[i].score = score;
+          }
+        }
+      }
+    }
+  }
+  if (spots.empty()) {
+    return false;
+  }
+  found = *std::min_element(spots.begin(), spots.end(), betterSpot);
+  found.x += x;
+  found.y += y;
+  return true;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * The frame ring. With --frames a thread of its own, on a connection of its
+ * own, grabs the whole screen through MIT-SHM FPS times a second, so there
+ * is something to look at when a long replay goes wrong.
+ *
+ * A frame is kept as the XOR with the one before it, in runs of 32 bit
+ * words: a skip over what didn't change, a repeat of one word, or literal
+ * words. SSE2 does the XOR and steps over the unchanged words 4 at a time.
+ * Once a second there is a key frame, the XOR with nothing, which a plain
+ * background still makes small. When the ring holds more than --frames-mem,
+ * or frames older than --frames-keep, it drops the frames from the front up
+ * to the next key frame.
+ *
+ * DumpFrames, End with a code other than 0, SIGINT, SIGTERM and SIGUSR1
+ * write what is in the ring as PNGs to --frames-dir. The signals are
+ * blocked everywhere and the thread reads them from a signalfd, so no
+ * handler ever waits on a lock. After SIGINT and SIGTERM nothing more is
+ * played, and once the frames are written jayplay ends like it always did.
+ * When jayplay exits any other way frameStop, an atexit handler, stops the
+ * thread and joins it before the ring is taken apart.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+enum FrameRun { FRAME_SKIP, FRAME_REPEAT, FRAME_LITERAL };
+
+struct ScreenFrame {
+  long long ns;         // monotonic, when it was grabbed
+  bool key;             // the XOR with nothing
+  std::string runs;
+};
+struct FrameRing {
+  Display * dpy;        // the thread's own connection
+  Capture shot;
+  XImage format;        // how the pixels of a frame are laid out
+  size_t words;         // 32 bit words in a frame
+  unsigned long keyEvery;       // frames from one key frame to the next
+  std::vector<uint32_t> last, delta;
+  std::deque<ScreenFrame> frames;
+  size_t bytes;
+  unsigned long grabbed, dumps;
+  unsigned long long stored;    // bytes of every frame grabbed
+  int signals;          // a signalfd, only the thread takes the signals
+  sigset_t mask;        // and they are blocked everywhere else
+  int wake;             // an eventfd, written once stop is set
+  bool stop;
+  std::thread thread;
+  std::mutex mutex;
+};
+FrameRing Frames;
+
+// set when SIGINT or SIGTERM came, nothing more is played
+std::atomic<bool> FrameStopping(false);
+
+static inline void frameCount(std::string &out, FrameRun run, size_t count) {
+  unsigned long long v = ((unsigned long long)count << 2) | run;
+  while (v >= 0x80) {
+    out += (char)(v | 0x80);
+    v >>= 7;
+  }
+  out += (char)v;
+}
+// the runs that make now from last, last becomes now
+static void frameEncode(const uint32_t * now, uint32_t * last, uint32_t * d, size_t n,
+                        std::string &out) {
+  size_t i = 0;
+#if defined(__x86_64__)
+  for (; i + 4 <= n; i += 4) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(now + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(last + i));
+    _mm_storeu_si128((__m128i *)(d + i), _mm_xor_si128(a, b));
+    _mm_storeu_si128((__m128i *)(last + i), a);
+  }
+#endif
+  for (; i < n; i++) {
+    d[i] = now[i] ^ last[i];
+    last[i] = now[i];
+  }
+  i = 0;
+  while (i < n) {
+    size_t start = i;
+#if defined(__x86_64__)
+    __m128i zero = _mm_setzero_si128();
+    while (i + 4 <= n &&
+           _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(d + i)), zero)) == 0xffff) {
+      i += 4;
+    }
+#endif
+    while (i < n && d[i] == 0) {
+      i++;
+    }
+    if (i > start) {
+      frameCount(out, FRAME_SKIP, i - start);
+      continue;
+    }
+    size_t j = i + 1;
+    while (j < n && d[j] == d[i]) {
+      j++;
+    }
+    if (j - i >= 3) {
+      frameCount(out, FRAME_REPEAT, j - i);
+      out.append((const char *)&d[i], 4);
+      i = j;
+      continue;
+    }
+    // up to a word that didn't change or the start of a repeat
+    j = i + 1;
+    while (j < n && d[j] != 0 && !(j + 2 < n && d[j] == d[j + 1] && d[j] == d[j + 2])) {
+      j++;
+    }
+    frameCount(out, FRAME_LITERAL, j - i);
+    out.append((const char *)&d[i], (j - i) * 4);
+    i = j;
+  }
+}
+// applies the runs to the frame before, false when they don't fit
+static bool frameDecode(const std::string &runs, uint32_t * frame, size_t n) {
+  const unsigned char * p = (const unsigned char *)runs.data();
+  const unsigned char * end = p + runs.size();
+  size_t i = 0;
+  while (p < end) {
+    unsigned long long v = 0;
+    int shift = 0;
+    while (p < end && *p & 0x80 && shift < 63) {
+      v |= (unsigned long long)(*p++ & 0x7f) << shift;
+      shift += 7;
+    }
+    if (p == end) {
+      return false;
+    }
+    v |= (unsigned long long)*p++ << shift;
+    size_t count = v >> 2;
+    if (count > n - i) {
+      return false;
+    }
+    switch (v & 3) {
+      case FRAME_SKIP:
+        break;
+      case FRAME_REPEAT:
+        {
+          uint32_t word;
+          if (end - p < 4) {
+            return false;
+          }
+          memcpy(&word, p, 4);
+          p += 4;
+          for (size_t k = 0; k < count; k++) {
+            frame[i + k] ^= word;
+          }
+        }
+        break;
+      case FRAME_LITERAL:
+        if ((size_t)(end - p) < count * 4) {
+          return false;
+        }
+        for (size_t k = 0; k < count; k++, p += 4) {
+          uint32_t word;
+          memcpy(&word, p, 4);
+          frame[i + k] ^= word;
+        }
+        break;
+      default:
+        return false;
+    }
+    i += count;
+  }
+  return i == n;
+}
+static void frameWrite(const std::vector<uint32_t> &frame, const std::string &name) {
+  XImage view = Frames.format;
+  int w = view.width, h = view.height;
+  std::vector<unsigned char> rgb(w * h * 3);
+  view.data = (char *)&frame[0];
+  bool rgb32 = view.bits_per_pixel == 32 && view.red_mask == 0xff0000 &&
+               view.green_mask == 0xff00 && view.blue_mask == 0xff && view.byte_order == LSBFirst;
+  for (int y = 0; y < h; y++) {
+    unsigned char * out = &rgb[y * w * 3];
+    const unsigned char * p = (const unsigned char *)view.data + y * view.bytes_per_line;
+    for (int x = 0; x < w; x++, out += 3, p += 4) {
+      if (rgb32) {
+        out[0] = p[2];
+        out[1] = p[1];
+        out[2] = p[0];
+      } else {
+        int c[3];
+        captureRgb(Frames.shot, &view, x, y, c);
+        out[0] = c[0];
+        out[1] = c[1];
+        out[2] = c[2];
+      }
+    }
+  }
+  png_image png;
+  memset(&png, 0, sizeof(png));
+  png.version = PNG_IMAGE_VERSION;
+  png.width = w;
+  png.height = h;
+  png.format = PNG_FORMAT_RGB;
+#ifdef PNG_IMAGE_FLAG_FAST
+  png.flags = PNG_IMAGE_FLAG_FAST;
+#endif
+  if (!png_image_write_to_file(&png, name.c_str(), 0, &rgb[0], 0, NULL)) {
+    std::cerr << "Could not write " << name << ": " << png.message << std::endl;
+  }
+}
+// writes the frames in the ring as DIR/dumpN-NNNN.png
+static void frameDump(const char * why) {
+  std::lock_guard<std::mutex> lock(Frames.mutex);
+  if (Frames.frames.empty()) {
+    return;
+  }
+  if (mkdir(FrameDir.c_str(), 0755) != 0 && errno != EEXIST) {
+    std::cerr << "Could not make " << FrameDir << ": " << strerror(errno) << std::endl;
+    return;
+  }
+  Frames.dumps++;
+  std::vector<uint32_t> frame(Frames.words, 0);
+  char name[32];
+  size_t written = 0;
+  for (size_t i = 0; i < Frames.frames.size(); i++) {
+    const ScreenFrame &f = Frames.frames[i];
+    if (f.key) {
+      std::fill(frame.begin(), frame.end(), 0);
+    }
+    if (!frameDecode(f.runs, &frame[0], frame.size())) {
+      std::cerr << "Frame " << i << " is damaged, the dump stops there" << std::endl;
+      break;
+    }
+    snprintf(name, sizeof(name), "/dump%lu-%04lu.png", Frames.dumps, (unsigned long)i);
+    frameWrite(frame, FrameDir + name);
+    written++;
+  }
+  double seconds = (Frames.frames.back().ns - Frames.frames.front().ns) / 1e9;
+  std::cerr << "Frames: " << written << " frames of the last " << std::fixed << std::setprecision(1)
+            << seconds << "s in " << FrameDir << "/dump" << Frames.dumps << "-*.png, "
+            << why << std::endl;
+  std::cerr.unsetf(std::ios::floatfield);
+}
+static void frameGrab() {
+  // a dump may be reading the colormap, it is swapped in under the lock
+  Capture colormap;
+  colormap.fb = Frames.shot.fb;
+  capturePalette(Frames.dpy, colormap);
+  if (colormap.palette != Frames.shot.palette) {
+    std::lock_guard<std::mutex> lock(Frames.mutex);
+    Frames.shot.palette.swap(colormap.palette);
+  }
+  XImage * image = captureGrab(Frames.dpy, Frames.shot, 0, 0, Frames.shot.width, Frames.shot.height);
+  if (image == NULL) {
+    return;
+  }
+  ScreenFrame frame;
+  frame.ns = monotonicNow();
+  frame.key = Frames.grabbed % Frames.keyEvery == 0;
+  if (frame.key) {
+    std::fill(Frames.last.begin(), Frames.last.end(), 0);
+  }
+  frameEncode((const uint32_t *)image->data, &Frames.last[0], &Frames.delta[0], Frames.words, frame.runs);
+  Frames.grabbed++;
+  Frames.stored += frame.runs.size();
+
+  std::lock_guard<std::mutex> lock(Frames.mutex);
+  long long oldest = frame.ns - FrameKeep;
+  Frames.bytes += frame.runs.size();
+  Frames.frames.push_back(std::move(frame));
+  while (Frames.bytes > FrameMemory || Frames.frames.front().ns < oldest) {
+    // the ring always starts with a key frame, the frames up to the next
+    // one go together
+    size_t next = 1;
+    while (next < Frames.frames.size() && !Frames.frames[next].key) {
+      next++;
+    }
+    if (next == Frames.frames.size()) {
+      break;
+    }
+    for (size_t i = 0; i < next; i++) {
+      Frames.bytes -= Frames.frames.front().runs.size();
+      Frames.frames.pop_front();
+    }
+  }
+}
+static void frameLoop() {
+  long long period = (long long)(1e9 / FrameRate);
+  long long next = monotonicNow();
+  while (true) {
+    long long now = monotonicNow();
+    struct pollfd fds[2] = { { Frames.signals, POLLIN, 0 }, { Frames.wake, POLLIN, 0 } };
+    if (next > now && poll(fds, 2, (int)((next - now + 999999) / 1000000)) > 0) {
+      if (fds[1].revents & POLLIN) {
+        std::lock_guard<std::mutex> lock(Frames.mutex);
+        if (Frames.stop) {
+          return;
+        }
+      }
+      struct signalfd_siginfo info;
+      if ((fds[0].revents & POLLIN) &&
+          read(Frames.signals, &info, sizeof(info)) == (ssize_t)sizeof(info)) {
+        int sig = info.ssi_signo;
+        FrameStopping = sig != SIGUSR1;
+        frameDump(strsignal(sig));
+        if (sig != SIGUSR1) {
+          // die from it like before, it is only unblocked on this thread
+          sigset_t mask;
+          sigemptyset(&mask);
+          sigaddset(&mask, sig);
+          signal(sig, SIG_DFL);
+          pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+          raise(sig);
+        }
+      }
+      continue;
+    }
+    frameGrab();
+    // a frame that is late is left out
+    next += period;
+    if (next < monotonicNow()) {
+      next = monotonicNow() + period;
+    }
+  }
+}
+// ends the thread, at exit, while the ring and its lock are still there
+static void frameStop() {
+  if (!Frames.thread.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(Frames.mutex);
+    Frames.stop = true;
+  }
+  uint64_t one = 1;
+  if (write(Frames.wake, &one, sizeof(one)) != (ssize_t)sizeof(one)) {
+    std::cerr << "Could not stop the frame thread: " << strerror(errno) << std::endl;
+    return;
+  }
+  Frames.thread.join();
+}
+// opens the thread's connection and starts it, before anything is played
+static void frameStart(const char * display) {
+  Frames.dpy = XOpenDisplay(display);
+  if (Frames.dpy == NULL) {
+    std::cerr << "Could not open " << display << " again for --frames" << std::endl;
+    return;
+  }
+  captureInit(Frames.dpy, Frames.shot);
+  XImage * image = captureGrab(Frames.dpy, Frames.shot, 0, 0, Frames.shot.width, Frames.shot.height);
+  if (image == NULL || image->bitmap_pad != 32) {
+    std::cerr << "Could not grab the screen for --frames" << std::endl;
+    return;
+  }
+  Frames.format = *image;
+  Frames.format.data = NULL;
+  Frames.words = image->bytes_per_line * image->height / 4;
+  // a second, or less when the ring keeps less than two
+  Frames.keyEvery = std::max(1L, (long)(FrameRate * std::min(1.0, FrameKeep / 2e9)));
+  Frames.last.assign(Frames.words, 0);
+  Frames.delta.resize(Frames.words);
+  // blocked on every thread, the new one inherits the mask, and read from
+  // the signalfd by the frame thread
+  sigemptyset(&Frames.mask);
+  sigaddset(&Frames.mask, SIGINT);
+  sigaddset(&Frames.mask, SIGTERM);
+  sigaddset(&Frames.mask, SIGUSR1);
+  Frames.signals = signalfd(-1, &Frames.mask, SFD_CLOEXEC);
+  if (Frames.signals < 0) {
+    std::cerr << "No signalfd for --frames: " << strerror(errno) << std::endl;
+    return;
+  }
+  Frames.wake = eventfd(0, EFD_CLOEXEC);
+  if (Frames.wake < 0) {
+    std::cerr << "No eventfd for --frames: " << strerror(errno) << std::endl;
+    return;
+  }
+  pthread_sigmask(SIG_BLOCK, &Frames.mask, NULL);
+  // it grabs until jayplay exits
+  atexit(frameStop);
+  Frames.thread = std::thread(frameLoop);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Trim whitespace with an std::string
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+// trim from start
+static inline std::string &ltrim(std::string &s) {
+//   std::cout << "ltrim recv: " << s << std::endl;
+  if (s.empty())
+    return s;
+  s.erase(s.begin(), std::find_if(s.begin(), s.end(), std::not1(std::ptr_fun<int, int>(std::isspace))));
+  return s;
+}
+
+// trim from end
+static inline std::string &rtrim(std::string &s) {
+//    std::cout << "rtrim recv: " << s << std::endl;
+  if (s.empty())
+    return s;
+  s.erase(std::find_if(s.rbegin(), s.rend(), std::not1(std::ptr_fun<int, int>(std::isspace))).base(), s.end());
+  return s;
+}
+// trim from both ends
+static inline std::string &trim(std::string &s) {
+//   std::cout << "trying to trim : '" << s << "'" << std::endl;
+  if (s.empty()) {
+//     std::cout << "s is empty: '" << s << "'" << std::endl;
+    return s;
+  }
+  return ltrim(rtrim(s));
+}
+static inline void saveRegexResult(boost::smatch &what) {
+    size_t i;
+    // the captures go into the registers 0, 1, 2...
+    while (CaptureSlots.size() < what.size()) {
+      std::stringstream sind;
+      sind << CaptureSlots.size();
+      CaptureSlots.push_back(registerSlot(sind.str()));
+    }
+    for(i = 0; i < what.size(); ++i) {
+      Registers[CaptureSlots[i]].Set(what[i]);
+    }
+      
+}
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Patterns for like that are only known at runtime, because they come out of
+ * a register, are compiled once and kept in a small LRU cache. The hit and
+ * miss counters are printed when jayplay exits.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+class RegexCache {
+  public:
+    RegexCache(size_t capacity) : hits(0), misses(0), p_capacity(capacity) {}
+    const boost::regex * Get(const std::string &pattern) {
+      std::unordered_map<std::string,EntryList::iterator>::iterator it = p_index.find(pattern);
+      if (it != p_index.end()) {
+        hits++;
+        // move it to the front, it is now the most recently used
+        p_entries.splice(p_entries.begin(), p_entries, it->second);
+        return &it->second->second;
+      }
+      misses++;
+      boost::regex expr;
+      try {
+        expr.assign(pattern);
+      } catch (boost::regex_error &e) {
+        std::cerr << "Invalid regular expression '" << pattern << "': " << e.what() << std::endl;
+        return NULL;
+      }
+      p_entries.push_front(std::make_pair(pattern, expr));
+      p_index[pattern] = p_entries.begin();
+      if (p_entries.size() > p_capacity) {
+        p_index.erase(p_entries.back().first);
+        p_entries.pop_back();
+      }
+      return &p_entries.front().second;
+    }
+    unsigned long hits;
+    unsigned long misses;
+  private:
+    typedef std::list< std::pair<std::string,boost::regex> > EntryList;
+    size_t p_capacity;
+    EntryList p_entries;
+    std::unordered_map<std::string,EntryList::iterator> p_index;
+};
+RegexCache LikePatterns(64);
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Fill in a Condition from its three tokens. If the pattern of a like has no
+ * register in it, it will never change, so we compile it now.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void compilePattern(Condition &cond);
+static void compileCondition(Condition &cond, std::string ltoken,
+                             std::string comp, std::string rtoken) {
+  cond.ltoken.Compile(ltoken);
+  cond.comp = comp;
+  cond.rtoken.Compile(rtoken);
+  compilePattern(cond);
+}
+static void compilePattern(Condition &cond) {
+  cond.compiled = false;
+  if (cond.comp == "like" && cond.rtoken.IsConstant()) {
+    std::string pattern;
+    cond.rtoken.Render(pattern);
+    try {
+      cond.pattern.assign(pattern);
+      cond.compiled = true;
+    } catch (boost::regex_error &e) {
+      std::cerr << "Invalid regular expression '" << pattern << "': " << e.what() << std::endl;
+    }
+  }
+}
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * A condition that is an expression, like ${x} lt 10
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void compileCondition(Condition &cond, std::string text) {
+  cond.comp.clear();
+  cond.compiled = false;
+  if (!cond.expr.Compile(text, true)) {
+    std::cerr << "Invalid condition: " << text << std::endl;
+  }
+}
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Split a post-if ("helloWorld if ${test} is 1") into the line to run and
+ * its condition. Returns false for a normal line.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static bool splitPostIf(std::string &str, std::string &body, Condition &cond) {
+  static const boost::regex expr("(.*) if (.*)");
+  static const boost::regex expr2("(.*) (is|not|like) (.*)");
+  boost::smatch what;
+  if (str.find(" if ") == std::string::npos || !boost::regex_match(str,what,expr)) {
+    return false;
+  }
+  boost::smatch what2;
+  std::string nstr = what[2];
+  body = what[1];
+  if (boost::regex_match(nstr,what2,expr2)) {
+    compileCondition(cond, what2[1], what2[2], what2[3]);
+  } else {
+    compileCondition(cond, nstr);
+  }
+  return true;
+}
+static inline bool conditionResult(Condition &cond) {
+  static std::string ltoken, rtoken;
+  if (cond.comp.empty()) {
+    static Variable result;
+    return cond.expr.Evaluate(result) && result.ToDouble() != 0;
+  }
+  cond.ltoken.Render(ltoken);
+  if (cond.compiled) {
+    boost::smatch what;
+    if (boost::regex_match(ltoken,what,cond.pattern)) {
+      saveRegexResult(what);
+      return true;
+    }
+    return false;
+  }
+  cond.rtoken.Render(rtoken);
+  return expressionResult(ltoken,cond.comp,rtoken);
+}
+static inline bool expressionResult(std::string &ltoken, 
+                                    std::string &comp, 
+                                    std::string & rtoken)
+{
+//      std::cout << "(" << ltoken << " " << comp << " " << rtoken << ")" << std::endl;
+    if (comp == "is" && ltoken == rtoken)
+      return true;
+    if (comp == "not" && ltoken != rtoken)
+      return true;
+    if (comp == "like") {
+      // we have to use a regular expression, which should be rtoken
+      const boost::regex * expr = LikePatterns.Get(rtoken);
+      boost::smatch what;
+      if (expr && boost::regex_match(ltoken,what,*expr)) {
+        saveRegexResult(what);
+        return true;
+      }
+    }
+    return false;
+}
+
+static inline void executeIf(Instruction &ins) {
+    bool istrue = conditionResult(ins.cond);
+    if (istrue) {
+      // the body is just the next lines, endif does nothing
+      return;
+    }
+    // skip to the line after the matching else or endif
+    Index = blockTarget(ins);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Decode a single line into an Instruction. This is the only place where
+ * the text of a line is tokenized, everything executeInstruction needs is
+ * pulled out here once, when the script is loaded.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void clearInstruction(Instruction &ins) {
+    ins.op = OP_NOP;
+    ins.arg.clear();
+    ins.arg2.clear();
+    ins.text.clear();
+    ins.x = ins.y = 0;
+    ins.w = ins.h = 0;
+    ins.b = 0;
+    ins.ns = 0;
+    ins.ks = NoSymbol;
+    ins.kc = 0;
+    ins.reg = ins.reg2 = -1;
+    ins.target = -1;
+    ins.tail = false;
+    ins.postif = false;
+}
+static void decodeLine(std::string &sline, Instruction &ins) {
+    // building a stringstream for every line is most of the load time of a
+    // big recording, so there is just the one
+    static std::stringstream myfile;
+    std::string ev;
+    unsigned int code;
+
+    clearInstruction(ins);
+
+    std::string body;
+    if (splitPostIf(sline, body, ins.cond)) {
+      decodeLine(body, ins);
+      ins.postif = true;
+      return;
+    }
+
+    myfile.clear();
+    myfile.str(sline);
+    myfile >> ev;
+    if (ev.empty()) {
+      return;
+    }
+    if (ev[0] == '#') {
+      ins.op = OP_COMMENT;
+      ins.text = ev;
+      return;
+    }
+    // anything we don't know might be the name of a label
+    ins.op = OP_CALL;
+    for (const OpName * o = OpNames; o->name; o++) {
+      if (!strcasecmp(o->name, ev.c_str())) {
+        ins.op = o->op;
+        break;
+      }
+    }
+    switch (ins.op) {
+      case OP_SET:
+        myfile >> ins.arg;
+        if (ins.arg.find("++") != std::string::npos) {
+          ins.arg.replace(ins.arg.find("++"),2,"");
+          ins.op = OP_INCREMENT;
+        } else if (ins.arg.find("--") != std::string::npos) {
+          ins.arg.replace(ins.arg.find("--"),2,"");
+          ins.op = OP_DECREMENT;
+        } else {
+          std::getline(myfile, ins.text);
+          trim(ins.text);
+          ins.value.Compile(ins.text);
+        }
+        ins.reg = registerSlot(ins.arg);
+        break;
+      case OP_FILEOPEN:
+        myfile >> ins.arg;
+        std::getline(myfile, ins.text);
+        ins.value.Compile(ins.text);
+        break;
+      case OP_IN:
+        myfile >> ins.arg;
+        std::getline(myfile, ins.text);
+        ins.reg = registerSlot(ins.arg);
+        break;
+      case OP_FILEREADALL:
+      case OP_FILELENGTH:
+        myfile >> ins.arg >> ins.arg2;
+        ins.reg2 = registerSlot(ins.arg2);
+        break;
+      case OP_PREG:
+        myfile >> ins.arg;
+        ins.reg = registerSlot(ins.arg);
+        break;
+      case OP_GOTO:
+        myfile >> ins.arg;
+        trim(ins.arg);
+        break;
+      case OP_DELAY:
+        {
+          // seconds, with a fraction or in ms, us or ns: 1.5, 250ms, 500us
+          double value = 0;
+          char * unit;
+          myfile >> ins.arg;
+          value = strtod(ins.arg.c_str(), &unit);
+          if (!strcmp(unit, "ms")) {
+            value /= 1e3;
+          } else if (!strcmp(unit, "us")) {
+            value /= 1e6;
+          } else if (!strcmp(unit, "ns")) {
+            value /= 1e9;
+          } else if (*unit && strcmp(unit, "s")) {
+            std::cerr << "Invalid delay: " << sline << std::endl;
+          }
+          ins.b = (unsigned int)value;
+          ins.ns = (long long)(value * 1e9 + 0.5);
+        }
+        break;
+      case OP_USLEEP:
+        myfile >> ins.b;
+        ins.ns = ins.b * 1000LL;
+        break;
+      case OP_SETMOUSEDELAY:
+      case OP_SETKEYPRESSDELAY:
+      case OP_SETDELAY:
+      case OP_BUTTONPRESS:
+      case OP_BUTTONRELEASE:
+        myfile >> ins.b;
+        break;
+      case OP_MOVE:
+      case OP_RELATIVEMOVE:
+      case OP_MOTIONNOTIFY:
+        myfile >> ins.x >> ins.y;
+        break;
+      case OP_KEYCODEPRESS:
+      case OP_KEYCODERELEASE:
+        // read it as a number, KeyCode is a char and >> would take one digit
+        code = 0;
+        myfile >> code;
+        ins.kc = (KeyCode)code;
+        break;
+      case OP_KEYSYM:
+      case OP_KEYSYMPRESS:
+      case OP_KEYSYMRELEASE:
+        myfile >> ins.ks;
+        break;
+      case OP_KEYSTR:
+      case OP_KEYSTRPRESS:
+      case OP_KEYSTRRELEASE:
+        myfile >> ins.arg;
+        ins.ks = XStringToKeysym(ins.arg.c_str());
+        break;
+      case OP_SEND:
+      case OP_EXEC:
+      case OP_MOVEWINDOW:
+      case OP_FOCUS:
+        myfile.ignore();
+        std::getline(myfile, ins.text);
+        break;
+      case OP_PRINT:
+        std::getline(myfile, ins.text);
+        trim(ins.text);
+        ins.value.Compile(ins.text, false);
+        break;
+      case OP_END:
+        // the exit code, which may come from a register
+        std::getline(myfile, ins.text);
+        trim(ins.text);
+        if (!ins.text.empty()) {
+          ins.value.Compile(ins.text);
+        }
+        break;
+      case OP_WAITFORWINDOW:
+      case OP_WAITFORMAP:
+      case OP_WAITFORFOCUS:
+      case OP_WAITFORCLOSE:
+        {
+          // "a title" or a single word, the timeout in ms and the register
+          // that gets 1, or 0 when it timed out
+          myfile >> std::ws;
+          if (myfile.peek() == '"') {
+            myfile.ignore();
+            std::getline(myfile, ins.text, '"');
+          } else {
+            myfile >> ins.text;
+          }
+          myfile >> ins.b >> ins.arg;
+          ins.reg = registerSlot(ins.arg.empty() ? "WAIT" : ins.arg);
+        }
+        break;
+      case OP_WAITIDLE:
+      case OP_WAITCHANGE:
+        // WaitIdle quiet timeout or WaitChange x y w h timeout, then the
+        // register like WaitFor...
+        if (ins.op == OP_WAITIDLE) {
+          myfile >> ins.x;
+        } else {
+          myfile >> ins.x >> ins.y >> ins.w >> ins.h;
+        }
+        myfile >> ins.b >> ins.arg;
+        ins.reg = registerSlot(ins.arg.empty() ? "WAIT" : ins.arg);
+        break;
+      case OP_PIXELHASH:
+        myfile >> ins.x >> ins.y >> ins.w >> ins.h >> ins.arg;
+        ins.reg = registerSlot(ins.arg);
+        break;
+      case OP_GETPIXEL:
+        myfile >> ins.x >> ins.y >> ins.arg;
+        ins.reg = registerSlot(ins.arg);
+        break;
+      case OP_FINDIMAGE:
+        {
+          // the picture, where to look, all or x,y,w,h, how good a match
+          // has to be from 0 to 1, and the registers for the middle of it
+          std::string region;
+          double threshold = 0;
+          myfile >> ins.text >> region >> threshold >> ins.arg >> ins.arg2;
+          if (region != "all" &&
+              sscanf(region.c_str(), "%d,%d,%d,%d", &ins.x, &ins.y, &ins.w, &ins.h) != 4) {
+            std::cerr << "FindImage region is all or x,y,w,h: " << region << std::endl;
+          }
+          ins.b = threshold <= 0 ? 0 : (unsigned int)(std::min(threshold, 1.0) * 1000 + 0.5);
+          ins.reg = registerSlot(ins.arg);
+          ins.reg2 = registerSlot(ins.arg2);
+        }
+        break;
+      case OP_IF:
+      case OP_WHILE:
+        {
+          std::string ltoken,comp,rtoken,rest;
+          std::getline(myfile, rest);
+          std::stringstream tokens(rest);
+          tokens >> ltoken >> comp >> rtoken;
+          if (comp == "is" || comp == "not" || comp == "like") {
+            compileCondition(ins.cond, ltoken, comp, rtoken);
+          } else {
+            compileCondition(ins.cond, trim(rest));
+          }
+        }
+        break;
+      case OP_FOR:
+        {
+          // for i START END [step STEP]
+          std::string token[3];
+          std::string word;
+          myfile >> ins.arg >> token[0] >> token[1];
+          if (myfile >> word && !strcasecmp(word.c_str(), "step")) {
+            myfile >> token[2];
+          } else {
+            token[2] = "1";
+          }
+          ins.reg = registerSlot(ins.arg);
+          ins.exprs.resize(3);
+          for (int i = 0; i < 3; i++) {
+            if (!ins.exprs[i].Compile(token[i], true)) {
+              std::cerr << "Invalid for: " << sline << std::endl;
+            }
+          }
+        }
+        break;
+      case OP_CALL:
+        ins.arg = ev;
+        break;
+      case OP_INCLUDE:
+        std::getline(myfile, ins.arg);
+        trim(ins.arg);
+        break;
+      default:
+        break;
+    }
+}
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * The same for an event of a binary recording, which is one of the lines
+ * jayrec writes, without the text. Text records go through decodeLine.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void eventInstruction(const RecordEvent &ev, Instruction &ins) {
+    clearInstruction(ins);
+    switch (ev.type) {
+      case REC_MOTION:
+        ins.op = OP_MOTIONNOTIFY;
+        ins.x = ev.x;
+        ins.y = ev.y;
+        break;
+      case REC_BUTTONPRESS:
+      case REC_BUTTONRELEASE:
+        ins.op = ev.type == REC_BUTTONPRESS ? OP_BUTTONPRESS : OP_BUTTONRELEASE;
+        ins.b = ev.b;
+        break;
+      case REC_KEYPRESS:
+      case REC_KEYRELEASE:
+        ins.op = ev.type == REC_KEYPRESS ? OP_KEYSTRPRESS : OP_KEYSTRRELEASE;
+        ins.arg.assign(ev.text, ev.length);
+        ins.ks = XStringToKeysym(ins.arg.c_str());
+        break;
+      case REC_CHECKPOINT:
+        // only the one playback starts from does anything
+        if (StartAt && (long)ev.checkpoint.number == StartCheckpoint) {
+          ins.op = OP_RESTORE;
+          ins.x = ev.checkpoint.x;
+          ins.y = ev.checkpoint.y;
+          ins.b = ev.checkpoint.buttons;
+          for (size_t i = 0; i < ev.checkpoint.keys.size(); i++) {
+            ins.text += (i ? " " : "") + ev.checkpoint.keys[i];
+          }
+          // the time since the event before it was never played
+          return;
+        }
+        break;
+      default:
+        return;
+    }
+    // the time since the previous record is waited out before this one
+    ins.ns = ev.time * 1000000LL;
+    if (ev.time > 0 && !RecordedTimes) {
+      // the recording has its own pauses, the delays would only add to them
+      RecordedTimes = true;
+      MouseDelay = KeyPressDelay = Delay = 0;
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Labels can be declared after they are used, so jump targets are filled in
+ * once the whole file has been read.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void resolveInstruction(Instruction &ins) {
+    std::map<std::string,int>::iterator it;
+    if (ins.op == OP_GOTO) {
+      it = Labels.find(ins.arg);
+      if (it == Labels.end()) {
+        std::cerr << "Goto to unknown label: " << ins.arg << std::endl;
+        ins.target = 0;
+      } else {
+        ins.target = it->second;
+      }
+    } else if (ins.op == OP_CALL) {
+      it = Labels.find(ins.arg);
+      if (it == Labels.end()) {
+        ins.op = OP_NOP;
+      } else {
+        ins.target = it->second;
+      }
+    }
+}
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Is the counter of a For still within its end? Counting down when the step
+ * is negative.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static inline bool forContinues(Instruction &loop) {
+    static Variable end, step;
+    Variable &counter = Registers[loop.reg];
+    if (!loop.exprs[1].Evaluate(end) || !loop.exprs[2].Evaluate(step) || !counter.IsNumeric()) {
+      return false;
+    }
+    if (counter.Type() == _VINT && end.Type() == _VINT) {
+      return step.ToDouble() < 0 ? counter.ToInt() >= end.ToInt() : counter.ToInt() <= end.ToInt();
+    }
+    return step.ToDouble() < 0 ? counter.ToDouble() >= end.ToDouble() : counter.ToDouble() <= end.ToDouble();
 }
-/*****************************************************************************
- * Convert std::string to char *
- * **************************************************************************/
 
-char * stringToCharz(std::string str) {
-  char * new_str = new char[str.size() + 1];
-  std::copy(str.begin(), str.end(), new_str);
-  new_str[str.size()] = '\0';
-  return new_str;
+static inline void executeInstruction(Instruction &ins) {
+    char str[1024];
+    unsigned int b;
+    KeyCode kc;
+
+    // an event of a recording comes when it did, Delay and USleep wait below
+    if (ins.ns > 0 && ins.op != OP_DELAY && ins.op != OP_USLEEP) {
+      timelineWait(ins.ns);
+    }
+    switch (ins.op) {
+      case OP_COMMENT:
+        std::cout << "Comment: " << ins.text << std::endl;
+        return;
+      case OP_END:
+        {
+          int code = 0;
+          if (!ins.text.empty()) {
+            std::string out;
+            code = atoi(ins.value.Render(out).c_str());
+          }
+          flushEvents();
+          if (code != 0 && FrameRate > 0) {
+            snprintf(str, sizeof(str), "End %d", code);
+            frameDump(str);
+          }
+          exit(code);
+        }
+      case OP_DUMPFRAMES:
+        if (FrameRate > 0) {
+          frameDump("DumpFrames");
+        } else {
+          std::cerr << "DumpFrames needs --frames" << std::endl;
+        }
+        break;
+      case OP_ENDL:
+        std::cout << std::endl;
+        break;
+      case OP_SET:
+        {
+          ins.value.Assign(Registers[ins.reg]);
+        }
+        break;
+      case OP_INCREMENT:
+        Registers[ins.reg].Add(1);
+        break;
+      case OP_DECREMENT:
+        Registers[ins.reg].Add(-1);
+        break;
+      case OP_FILEOPEN:
+        {
+          std::string fpath;
+          file_object * fob = OpenFiles[ins.arg];
+          if (fob == NULL) {
+            fob = new file_object;
+          }
+          ins.value.Render(fpath);
+          trim(fpath);
+          fob->name = stringToCharz(fpath);
+          // opening a pipe waits for the other end
+          flushEvents();
+          std::ifstream f(fpath.c_str());
+          f.seekg(0, std::ios::end);
+          fob->length = f.tellg();
+          f.seekg(0,std::ios::beg);
+          fob->cpos = f.tellg();
+          f.close();
+          OpenFiles[ins.arg] = fob;
+        }
+        break;
+      case OP_FILEREADALL:
+        {
+          flushEvents();
+          std::ifstream f(OpenFiles[ins.arg]->name);
+          std::string str((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+          Registers[ins.reg2].Set(str);
+          f.close();
+        }
+        break;
+      case OP_FILELENGTH:
+        Registers[ins.reg2].SetInt(OpenFiles[ins.arg]->length);
+        break;
+      case OP_IN:
+        {
+          std::string value;
+          strncpy(str, ins.text.c_str(), sizeof(str) - 1);
+          str[sizeof(str) - 1] = 0;
+          std::cout << trimWhitespace(str) << " ";
+          flushEvents();
+          std::cin >> value;
+          timelineRestart();
+          Registers[ins.reg].Set(trim(value));
+        }
+        break;
+      case OP_IF:
+        executeIf(ins);
+        break;
+      case OP_ELSE:
+        // we get here at the end of the true branch, skip the false one
+        {
+          int target = blockTarget(ins);
+          if (target >= 0) {
+            Index = target;
+          }
+        }
+        break;
+      case OP_FOR:
+        if (!ins.exprs[0].Evaluate(Registers[ins.reg])) {
+          std::cerr << "for: start of " << ins.arg << " is not a number" << std::endl;
+          Index = blockTarget(ins);
+        } else if (!forContinues(ins)) {
+          Index = blockTarget(ins);
+        }
+        break;
+      case OP_NEXT:
+        {
+          // when streaming the For may have to be read again, which can
+          // throw this line out of the window, so ins is done with here
+          int forLine = ins.target;
+          Instruction * forIns = forLine >= 0 ? programLine(forLine) : NULL;
+          if (forIns == NULL) {
+            break;
+          }
+          Instruction &loop = *forIns;
+          Variable &counter = Registers[loop.reg];
+          static Variable step;
+          if (!loop.exprs[2].Evaluate(step)) {
+            break;
+          }
+          if (counter.Type() == _VINT && step.Type() == _VINT) {
+            counter.Add(step.ToInt());
+          } else {
+            counter.SetDouble(counter.ToDouble() + step.ToDouble());
+          }
+          if (forContinues(loop)) {
+            Index = forLine + 1;
+          }
+        }
+        break;
+      case OP_WHILE:
+        if (!conditionResult(ins.cond)) {
+          Index = blockTarget(ins);
+        }
+        break;
+      case OP_WEND:
+      case OP_BREAKLOOP:
+      case OP_CONTINUE:
+        {
+          // -1 would end the script, a line without a block carries on
+          int target = blockTarget(ins);
+          if (target >= 0) {
+            Index = target;
+          }
+        }
+        break;
+      case OP_PREG:
+        std::cout << Registers[ins.reg].ToString() << std::endl;
+        break;
+      case OP_DELAY:
+        std::cout << "Delay: " << ins.arg << std::endl;
+        timelineWait ( ins.ns );
+        break;
+      case OP_SETMOUSEDELAY:
+        std::cout << "Delay: " << ins.b << std::endl;
+        MouseDelay = ins.b;
+        break;
+      case OP_SETKEYPRESSDELAY:
+        std::cout << "Delay: " << ins.b << std::endl;
+        KeyPressDelay = ins.b;
+        break;
+      case OP_SETDELAY:
+        std::cout << "Delay: " << ins.b << std::endl;
+        Delay = ins.b;
+        break;
+      case OP_USLEEP:
+        std::cout << "USleep: " << ins.b << std::endl;
+        timelineWait ( ins.ns );
+        break;
+      case OP_PRINT:
+        ins.value.Write(std::cout);
+        break;
+      case OP_RETURN:
+        //std::cout << "Returning" << std::endl;
+        if (CallStack.empty()) {
+          // nothing to return to, go back to where the first goto left off
+          Index = Registers[SCSSlot].ToInt();
+        } else {
+          Index = CallStack.back().ret;
+          CallStack.pop_back();
+        }
+        break;
+      case OP_BREAK:
+        {
+          Index = Registers[SCSSlot].ToInt();
+          CallStack.clear();
+        }
+        break;
+      case OP_GOTO:
+      case OP_CALL:
+        {
+          if (ins.target < 0 && Streaming) {
+            // the label is further down, read ahead to it
+            streamFindLabel(ins);
+            if (ins.op == OP_NOP) {
+              break;
+            }
+          }
+          // Index already points at the line after this one
+          int here = Index - 1;
+          int entry = CallStack.empty() ? Entry : CallStack.back().entry;
+          if (CallStack.empty()) {
+            Registers[SCSSlot].SetInt(Index);
+          }
+          if (ins.op == OP_GOTO && ins.target <= here && ins.target >= entry) {
+            // a goto back inside the current frame is a loop, not a call
+          } else if (ins.tail && !CallStack.empty()) {
+            // we would only come back here to Return, so reuse the frame
+            CallStack.back().entry = ins.target;
+          } else {
+            if ((int)CallStack.size() >= _StackDepth) {
+              std::cerr << "Call stack too deep (" << _StackDepth
+                        << " frames) calling '" << ins.arg << "', aborting."
+                        << std::endl;
+              exit(-1);
+            }
+            Frame f;
+            f.ret = Index;
+            f.entry = ins.target;
+            CallStack.push_back(f);
+          }
+          Index = ins.target;
+        }
+        break;
+      case OP_RESTORE:
+        {
+          std::cout << "Restore: " << ins.x << " " << ins.y << " buttons " << ins.b
+                    << " keys " << ins.text << std::endl;
+          fakeMotion ( GlobalDisplay, scale ( ins.x ), scale ( ins.y ), MouseDelay );
+          for (b = 1; b < 32; b++) {
+            if (ins.b & (1u << b)) {
+              fakeButton ( GlobalDisplay, b, True, Delay );
+            }
+          }
+          std::stringstream keys(ins.text);
+          std::string key;
+          while (keys >> key) {
+            if ( ( kc = keysymToKeycode ( GlobalDisplay, XStringToKeysym(key.c_str()) ) ) != 0 ) {
+              fakeKey ( GlobalDisplay, kc, True, KeyPressDelay );
+            }
+          }
+        }
+        break;
+      case OP_BUTTONPRESS:
+        std::cout << "ButtonPress: " << ins.b << std::endl;
+        fakeButton ( GlobalDisplay, ins.b, True, Delay );
+        break;
+      case OP_DOWN:
+        b = 1;
+        std::cout << "Down: " << b << std::endl;
+        fakeButton ( GlobalDisplay, b, True, Delay );
+        break;
+      case OP_CLICK:
+        b = 1;
+        fakeButton ( GlobalDisplay, b, True, Delay );
+        timelineWait ( 200000000LL );
+        fakeButton ( GlobalDisplay, b, False, Delay );
+        break;
+      case OP_BUTTONRELEASE:
+        std::cout << "ButtonRelease: " << ins.b << std::endl;
+        fakeButton ( GlobalDisplay, ins.b, False, Delay );
+        break;
+      case OP_UP:
+        b = 1;
+        std::cout << "Up: " << b << std::endl;
+        fakeButton ( GlobalDisplay, b, False, Delay );
+        break;
+      case OP_MOVE:
+        std::cout << "Move: " << ins.x << " " << ins.y << std::endl;
+        fakeMotion ( GlobalDisplay, scale ( ins.x ), scale ( ins.y ), MouseDelay );
+        break;
+      case OP_RELATIVEMOVE:
+        std::cout << "Move: " << ins.x << " " << ins.y << std::endl;
+        fakeRelativeMotion ( GlobalDisplay, scale ( ins.x ), scale ( ins.y ), MouseDelay );
+        break;
+      case OP_MOTIONNOTIFY:
+        std::cout << "MotionNotify: " << ins.x << " " << ins.y << std::endl;
+        fakeMotion ( GlobalDisplay, scale ( ins.x ), scale ( ins.y ), MouseDelay );
+        break;
+      case OP_KEYCODEPRESS:
+        std::cout << "KeyPress: " << (unsigned int)ins.kc << std::endl;
+        fakeKey ( GlobalDisplay, ins.kc, True, KeyPressDelay );
+        break;
+      case OP_KEYCODERELEASE:
+        std::cout << "KeyRelease: " << (unsigned int)ins.kc << std::endl;
+        fakeKey ( GlobalDisplay, ins.kc, False, KeyPressDelay );
+        break;
+      case OP_KEYSYM:
+      case OP_KEYSYMPRESS:
+      case OP_KEYSYMRELEASE:
+        if (ins.op == OP_KEYSYM) {
+          std::cout << "KeySym: " << ins.ks << std::endl;
+        } else if (ins.op == OP_KEYSYMPRESS) {
+          std::cout << "KeySymPress: " << ins.ks << std::endl;
+        } else {
+          std::cout << "KeySymRelease: " << ins.ks << std::endl;
+        }
+        if ( ( kc = keysymToKeycode ( GlobalDisplay, ins.ks ) ) == 0 )
+        {
+          std::cerr << "No keycode on remote display found for keysym: " << ins.ks << std::endl;
+          return;
+        }
+        if (ins.op != OP_KEYSYMRELEASE) {
+          fakeKey ( GlobalDisplay, kc, True, KeyPressDelay );
+        }
+        if (ins.op == OP_KEYSYM) {
+          fakeKey ( GlobalDisplay, kc, False, Delay );
+        }
+        if (ins.op == OP_KEYSYMRELEASE) {
+          fakeKey ( GlobalDisplay, kc, False, KeyPressDelay );
+        }
+        break;
+      case OP_KEYSTR:
+      case OP_KEYSTRPRESS:
+      case OP_KEYSTRRELEASE:
+        if (ins.op == OP_KEYSTR) {
+          std::cout << "KeyStr: " << ins.arg << std::endl;
+        } else if (ins.op == OP_KEYSTRPRESS) {
+          std::cout << "KeyStrPress: " << ins.arg << std::endl;
+        } else {
+          std::cout << "KeyStrRelease: " << ins.arg << std::endl;
+        }
+        if ( ( kc = keysymToKeycode ( GlobalDisplay, ins.ks ) ) == 0 )
+        {
+          std::cerr << "No keycode on remote display found for '" << ins.arg << "': " << ins.ks << std::endl;
+          return;
+        }
+        if (ins.op != OP_KEYSTRRELEASE) {
+          fakeKey ( GlobalDisplay, kc, True, KeyPressDelay );
+        }
+        if (ins.op != OP_KEYSTRPRESS) {
+          fakeKey ( GlobalDisplay, kc, False, KeyPressDelay );
+        }
+        break;
+      case OP_SEND:
+        keymapCheck(GlobalDisplay);
+        for (b = 0; b < ins.text.size(); b++) {
+          sendChar(GlobalDisplay, ins.text[b]);
+        }
+        break;
+      case OP_EXEC:
+        {
+          pid_t cpid;
+          flushEvents();
+          const char * command = ins.text.c_str();
+          cpid = fork();
+          if (cpid==0) {
+            // the parent may have threads, the child only makes calls that
+            // are safe after fork: the shell is exec'd directly instead of
+            // through system(), which forks again and takes locks
+            // the command gets the signals --frames blocks
+            sigprocmask(SIG_UNBLOCK, &Frames.mask, NULL);
+            execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+            // not exit(), the atexit handlers belong to the parent
+            _exit(127);
+          }
+        }
+        break;
+      case OP_INCLUDE:
+        // included scripts are put in place when the script is loaded
+        std::cerr << "Include only works in a script that isn't streamed: " << ins.arg << std::endl;
+        break;
+      case OP_MOVEWINDOW:
+        {
+          static const boost::regex expr("'(.*)',([\\s\\d]+),([\\s\\d]+)");
+          boost::smatch what;
+          strncpy(str, ins.text.c_str(), sizeof(str) - 1);
+          str[sizeof(str) - 1] = 0;
+          std::string s_str = trimWhitespace(str);
+          if (boost::regex_match(s_str,what,expr)) {
+            int x = stringToInt(what[2]);
+            int y = stringToInt(what[3]);
+            std::string name = what[1];
+            std::vector<Window> found;
+            std::cout << "MoveWindow " << name << " " << x << " " << y << std::endl;
+            windowFind(GlobalDisplay, name, found);
+            if (found.empty()) {
+              std::cerr << "No window matches: " << name << std::endl;
+            } else {
+              XMoveWindow(GlobalDisplay, found[0], x, y);
+              XFlush ( GlobalDisplay );
+            }
+          } //end if regex match
+        }
+        break;
+      case OP_FOCUS:
+        {
+          strncpy(str, ins.text.c_str(), sizeof(str) - 1);
+          str[sizeof(str) - 1] = 0;
+          std::string s_str = trimWhitespace(str);
+          if (s_str.length() < 3) {
+            return;
+          }
+          std::cout << "Focus: " << str << std::endl;
+          std::vector<Window> found;
+          Window root = RootWindow(GlobalDisplay,DefaultScreen(GlobalDisplay));
+          XEvent xev;
+          windowFind(GlobalDisplay, s_str, found);
+          if (found.empty()) {
+            std::cerr << "No window matches: " << s_str << std::endl;
+          }
+          for (size_t k = 0; k < found.size(); k++) {
+            xev.xclient.type = ClientMessage;
+            xev.xclient.serial = 0;
+            xev.xclient.send_event = True;
+            xev.xclient.display = GlobalDisplay;
+            xev.xclient.window = found[k];
+            xev.xclient.message_type = Windows.atoms[WA_ACTIVE_WINDOW];
+            xev.xclient.format = 32;
+            xev.xclient.data.l[0] = 2;
+            xev.xclient.data.l[1] = 0;
+            xev.xclient.data.l[2] = 0;
+            xev.xclient.data.l[3] = 0;
+            xev.xclient.data.l[4] = 0;
+            XSendEvent (GlobalDisplay,
+                        root, False,
+                        SubstructureRedirectMask | SubstructureNotifyMask,
+                        &xev);
+            XRaiseWindow(GlobalDisplay,found[k]);
+          }
+          XFlush ( GlobalDisplay );
+        }
+        break;
+      case OP_WAITFORWINDOW:
+      case OP_WAITFORMAP:
+      case OP_WAITFORFOCUS:
+      case OP_WAITFORCLOSE:
+        {
+          static const char * names[] = { "WaitForWindow", "WaitForMap", "WaitForFocus", "WaitForClose" };
+          long long start = monotonicNow();
+          bool done = windowWait(GlobalDisplay, ins.op, ins.text, ins.b);
+          std::cout << names[ins.op - OP_WAITFORWINDOW] << ": " << ins.text;
+          if (done) {
+            std::cout << " after " << (monotonicNow() - start) / 1000000 << "ms" << std::endl;
+          } else {
+            std::cout << " timed out after " << ins.b << "ms" << std::endl;
+          }
+          Registers[ins.reg].SetInt(done);
+          timelineRestart();
+        }
+        break;
+      case OP_WAITIDLE:
+      case OP_WAITCHANGE:
+        {
+          long long start = monotonicNow();
+          if (ins.op == OP_WAITCHANGE) {
+            int x = scale(ins.x), y = scale(ins.y);
+            Painted.region.x = x;
+            Painted.region.y = y;
+            Painted.region.width = std::max(0, scale(ins.x + ins.w) - x);
+            Painted.region.height = std::max(0, scale(ins.y + ins.h) - y);
+            Painted.changed = false;
+          }
+          bool done = damageWait(GlobalDisplay, ins.op, ins.op == OP_WAITIDLE ? ins.x : 0, ins.b);
+          long long took = (monotonicNow() - start) / 1000000;
+          if (ins.op == OP_WAITIDLE) {
+            std::cout << "WaitIdle: " << (done ? "quiet" : "still drawing");
+          } else {
+            std::cout << "WaitChange: " << (done ? "changed" : "no change");
+          }
+          std::cout << " after " << took << "ms" << std::endl;
+          Registers[ins.reg].SetInt(done);
+          timelineRestart();
+        }
+        break;
+      case OP_PIXELHASH:
+      case OP_GETPIXEL:
+        {
+          int x = scale(ins.x), y = scale(ins.y);
+          int w = ins.op == OP_GETPIXEL ? 1 : scale(ins.w);
+          int h = ins.op == OP_GETPIXEL ? 1 : scale(ins.h);
+          XImage * image = NULL;
+          if (!Shot.ready) {
+            captureInit(GlobalDisplay, Shot);
+          }
+          if (!captureClip(x, y, w, h) || !(image = captureRegion(GlobalDisplay, x, y, w, h))) {
+            std::cerr << "Nothing to capture at " << ins.x << " " << ins.y << std::endl;
+            Registers[ins.reg].Set("");
+            break;
+          }
+          if (ins.op == OP_GETPIXEL) {
+            Registers[ins.reg].Set(capturePixel(Shot, image, 0, 0));
+          } else {
+            snprintf(str, sizeof(str), "%08x", captureHash(Shot, image));
+            Registers[ins.reg].Set(str);
+          }
+          std::cout << (ins.op == OP_GETPIXEL ? "GetPixel: " : "PixelHash: ")
+                    << Registers[ins.reg].ToString() << std::endl;
+        }
+        break;
+      case OP_FINDIMAGE:
+        {
+          int x = scale(ins.x), y = scale(ins.y);
+          int w = ins.w > 0 ? scale(ins.w) : 0, h = ins.h > 0 ? scale(ins.h) : 0;
+          if (w == 0 || h == 0) {
+            x = y = 0;
+            w = DisplayWidth(GlobalDisplay, DefaultScreen(GlobalDisplay));
+            h = DisplayHeight(GlobalDisplay, DefaultScreen(GlobalDisplay));
+          }
+          long long start = monotonicNow();
+          FindSpot spot = { 0, 0, -2 };
+          bool found = findImage(GlobalDisplay, ins.text, x, y, w, h, spot) &&
+                       spot.score * 1000 >= ins.b;
+          long long took = (monotonicNow() - start) / 1000000;
+          std::cout << "FindImage: " << ins.text;
+          if (found) {
+            // the middle of it, in the coordinates of the script
+            const GrayImage &pic = Needles[ins.text][0].image;
+            Registers[ins.reg].SetInt((int)((spot.x + pic.width / 2) / Scale));
+            Registers[ins.reg2].SetInt((int)((spot.y + pic.height / 2) / Scale));
+            snprintf(str, sizeof(str), ", score %.3f", spot.score);
+            std::cout << " at " << Registers[ins.reg].ToString() << " "
+                      << Registers[ins.reg2].ToString() << str;
+          } else {
+            Registers[ins.reg].SetInt(-1);
+            Registers[ins.reg2].SetInt(-1);
+            std::cout << " not found";
+            if (spot.score > -2) {
+              snprintf(str, sizeof(str), ", best score %.3f", spot.score);
+              std::cout << str;
+            }
+          }
+          std::cout << ", in " << took << "ms" << std::endl;
+          timelineRestart();
+        }
+        break;
+      default:
+        // Restart, label, entry, endif and the like don't do anything when
+        // they are executed
+        break;
+    }
 }
-double stringToDouble(std::string str) {
-  std::stringstream s;
-  s.str(str);
-  double d;
-  s >> d;
-  return d;
+static void setTarget(int line, int target);
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Pair up every If with its else and endif, every For with its next and
+ * every While with its wend, nested blocks included.
+ *
+ * A false If jumps to the line after its else (or endif), an else that is
+ * reached from the true branch jumps to the line after the endif. For and
+ * While jump past the end of the loop when they are done, next and wend
+ * point back at their For and While. A break or continue inside a loop
+ * jumps to the end of the innermost one, a break outside of any loop is the
+ * old Break that goes back to SCS.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+struct Block {
+  int index;
+  OpCode op;
+  std::string text;     // for complaining when it's never closed
+  std::vector<int> breaks;
+  std::vector<int> continues;
+};
+std::vector<Block> OpenBlocks;
+static bool closeBlock(int index, OpCode first, const char * what, const boost::string_ref &text) {
+  if (OpenBlocks.empty() || OpenBlocks.back().op != first) {
+    std::cerr << what << " without a matching block: " << text << std::endl;
+    return false;
+  }
+  return true;
 }
-int stringToInt(std::string str) {
-  std::stringstream s;
-  s.str(str);
-  int d;
-  s >> d;
-  return d;
+static void closeLoop(int index, int end) {
+  Block &b = OpenBlocks.back();
+  setTarget(b.index, end);
+  for (size_t i = 0; i < b.breaks.size(); i++) {
+    setTarget(b.breaks[i], end);
+  }
+  // continue goes through next (or wend) so the loop is tested again
+  for (size_t i = 0; i < b.continues.size(); i++) {
+    setTarget(b.continues[i], index);
+  }
+  OpenBlocks.pop_back();
+}
+// lines come in one at a time, so this works for streaming too
+static void matchLine(int index, Instruction &ins, const boost::string_ref &text) {
+  int i;
+  if (ins.op == OP_BREAK || ins.op == OP_CONTINUE) {
+    // find the innermost loop, there may be ifs in between
+    for (i = (int)OpenBlocks.size() - 1; i >= 0; i--) {
+      if (OpenBlocks[i].op == OP_FOR || OpenBlocks[i].op == OP_WHILE) {
+        break;
+      }
+    }
+    if (i >= 0) {
+      if (ins.op == OP_BREAK) {
+        ins.op = OP_BREAKLOOP;
+        OpenBlocks[i].breaks.push_back(index);
+      } else {
+        OpenBlocks[i].continues.push_back(index);
+      }
+    } else if (ins.op == OP_CONTINUE) {
+      std::cerr << "continue outside of a loop: " << text << std::endl;
+      ins.op = OP_NOP;
+    }
+    return;
+  }
+  if (ins.postif) {
+    return;
+  }
+  if (ins.op == OP_IF || ins.op == OP_FOR || ins.op == OP_WHILE) {
+    Block b;
+    b.index = index;
+    b.op = ins.op;
+    b.text.assign(text.data(), text.size());
+    OpenBlocks.push_back(b);
+  } else if (ins.op == OP_ELSE) {
+    if (!closeBlock(index, OP_IF, "else", text)) {
+      // there is no endif to jump to
+      ins.op = OP_NOP;
+      return;
+    }
+    setTarget(OpenBlocks.back().index, index + 1);
+    OpenBlocks.back().index = index;
+    OpenBlocks.back().op = OP_ELSE;
+  } else if (ins.op == OP_ENDIF) {
+    if (OpenBlocks.empty() || (OpenBlocks.back().op != OP_IF &&
+                               OpenBlocks.back().op != OP_ELSE)) {
+      std::cerr << "endif without a matching block: " << text << std::endl;
+      return;
+    }
+    setTarget(OpenBlocks.back().index, index + 1);
+    OpenBlocks.pop_back();
+  } else if (ins.op == OP_NEXT || ins.op == OP_WEND) {
+    if (!closeBlock(index, ins.op == OP_NEXT ? OP_FOR : OP_WHILE,
+                    ins.op == OP_NEXT ? "next" : "wend", text)) {
+      // there is no loop to go back to
+      ins.op = OP_NOP;
+      return;
+    }
+    ins.target = OpenBlocks.back().index;
+    closeLoop(index, index + 1);
+  }
+}
+static void finishBlocks() {
+  while (!OpenBlocks.empty()) {
+    // not closed, the block runs to the end of the script
+    std::cerr << "Block is never closed: " << OpenBlocks.back().text << std::endl;
+    closeLoop(SourceNumLines, SourceNumLines);
+  }
+}
+static void matchBlocks() {
+  for (int index = 0; index < SourceNumLines; index++) {
+    matchLine(index, Program[index], Source[index]);
+  }
+  finishBlocks();
+}
+
+static bool mapFile(const char * fileName, ScriptMap &map) {
+  struct stat st;
+  int fd = open(fileName, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void * p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      madvise(p, st.st_size, MADV_SEQUENTIAL);
+      map.data = (const char *)p;
+      map.size = st.st_size;
+      map.mapped = true;
+      close(fd);
+      return true;
+    }
+  }
+  // not something we can map, read it all in instead
+  char buf[65536];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    map.buffer.append(buf, n);
+  }
+  close(fd);
+  map.data = map.buffer.data();
+  map.size = map.buffer.size();
+  map.mapped = false;
+  return true;
+}
+static void unmapFile(ScriptMap &map) {
+  if (map.mapped) {
+    munmap((void *)map.data, map.size);
+  }
+  map.data = NULL;
+  map.size = 0;
+  map.mapped = false;
+  map.buffer.clear();
+}
+
+// the first word of a line and what comes after it
+static inline boost::string_ref firstWord(boost::string_ref &rest) {
+  size_t i = 0;
+  while (i < rest.size() && !isspace(rest[i])) i++;
+  boost::string_ref word = rest.substr(0, i);
+  while (i < rest.size() && isspace(rest[i])) i++;
+  rest.remove_prefix(i);
+  return word;
+}
+
+// Now let's look at the string and find out some stuff about it
+static void noteLabel(int index, boost::string_ref rest) {
+  boost::string_ref token = firstWord(rest);
+  if (token == "label" || token == "function") {
+    std::string name(firstWord(rest));
+    Labels[name] = index + 1; // i.e. we goto the declaration line + 1
+  } else if ((token == "entry" || token == "main") && (!Streaming || Entry < 0)) {
+    // a stream keeps the first one, the script is running by the next
+    Entry = index;
+  }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * We need to have the entire file as a logical structure instead of just
+ * a stream of bits because we need to move back and forth in the file and
+ * using tellg just isn't cutting it. 
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static void loadRecording();
+static unsigned long long startCheckpoint(const std::vector<RecordIndexEntry> &index);
+static void addLine(int index, boost::string_ref view);
+static void linkProgram();
+static void loadModule(const std::string &fileName, const ScriptMap &map);
+static void simplifyMotion();
+
+void parseFileIntoStruct(char * fileName) {
+  SCSSlot = registerSlot("SCS");
+  if (!mapFile(fileName, Script)) {
+    std::cerr << PROG << ": could not open " << fileName << std::endl;
+    exit ( EXIT_FAILURE );
+  }
+  if (isRecording(Script.data, Script.size)) {
+    loadRecording();
+  } else {
+    if (StartAt) {
+      std::cerr << PROG << ": --start-at needs a binary recording" << std::endl;
+      exit ( EXIT_FAILURE );
+    }
+    loadModule(fileName, Script);
+    SourceNumLines = Program.size();
+    linkProgram();
+  }
+  if (PathTolerance > 0 || PathGap > 0) {
+    simplifyMotion();
+  }
+}
+
+// the lines of a script, decoded but not linked
+static void decodeScript(const ScriptMap &map, std::vector<Instruction> &lines,
+                         std::vector<boost::string_ref> &views) {
+  static std::string line;
+  const char * p = map.data;
+  const char * end = map.data + map.size;
+  // count the lines first, so neither table is copied around as it grows
+  size_t count = 1;
+  for (const char * nl = p; (nl = (const char *)memchr(nl, '\n', end - nl)); nl++) {
+    count++;
+  }
+  views.reserve(count);
+  lines.reserve(count);
+  while (p < end) {
+    // memchr is about as fast as looking for newlines gets
+    const char * nl = (const char *)memchr(p, '\n', end - p);
+    if (nl == NULL) {
+      nl = end;
+    }
+    const char * first = p;
+    const char * last = nl;
+    p = nl + 1;
+    while (first < last && isspace(*first)) first++;
+    while (last > first && isspace(last[-1])) last--;
+    if (first == last || *first == '#') {
+      continue;
+    }
+    views.push_back(boost::string_ref(first, last - first));
+    line.assign(first, last - first);
+    lines.push_back(Instruction());
+    decodeLine(line, lines.back());
+  }
+}
+
+// a binary recording, text records are treated like lines of a script
+static void loadRecording() {
+  RecordReader reader;
+  RecordEvent ev;
+  int index = 0;
+  int r;
+  const char * p = Script.data + JAYREC_HEADER;
+  const char * end = Script.data + Script.size;
+  if (StartAt) {
+    std::vector<RecordIndexEntry> index;
+    unsigned long long at;
+    if (!findIndex(Script.data, Script.size, 0, index, at)) {
+      // it wasn't finished properly, read through it for the checkpoints
+      scanCheckpoints(Script.data, Script.size, index);
+    }
+    p = Script.data + startCheckpoint(index);
+  }
+  while ((r = reader.Next(p, end, ev)) > 0) {
+    if (ev.type == REC_TEXT) {
+      addLine(index++, boost::string_ref(ev.text, ev.length));
+      continue;
+    }
+    Source.push_back(boost::string_ref());
+    Program.push_back(Instruction());
+    eventInstruction(ev, Program.back());
+    index++;
+  }
+  if (r < 0 || p != end) {
+    std::cerr << PROG << ": recording is damaged at byte " << p - Script.data
+              << ", playing what came before" << std::endl;
+  }
+  SourceNumLines = index;
+  linkProgram();
+}
+
+// a run ends at anything but a MotionNotify or a Delay
+static inline bool motionRun(const Instruction &ins) {
+  return !ins.postif && (ins.op == OP_MOTIONNOTIFY || ins.op == OP_DELAY);
+}
+// the motion of a run that simplifyPath leaves out becomes a NOP, lines
+// stay where they are for the jumps. Its time goes to the line after it.
+static void simplifyMotion() {
+  std::vector<PathPoint> path;
+  std::vector<int> lines;
+  std::vector<bool> keep;
+  long long clock = 0;
+  for (int index = 0; index <= SourceNumLines; index++) {
+    if (index < SourceNumLines && motionRun(Program[index])) {
+      Instruction &ins = Program[index];
+      clock += ins.ns;
+      if (ins.op == OP_MOTIONNOTIFY) {
+        PathPoint point = { ins.x, ins.y, (unsigned long)(clock / 1000000) };
+        path.push_back(point);
+        lines.push_back(index);
+      }
+      continue;
+    }
+    simplifyPath(path, PathTolerance, PathGap, keep);
+    for (size_t i = 0; i < lines.size(); i++) {
+      if (!keep[i]) {
+        Instruction &ins = Program[lines[i]];
+        // its pause goes to the line after it, if there is one
+        if ((size_t)lines[i] + 1 < Program.size()) {
+          Program[lines[i] + 1].ns += ins.ns;
+        }
+        clearInstruction(ins);
+        MotionDropped++;
+      }
+    }
+    MotionSeen += lines.size();
+    path.clear();
+    lines.clear();
+  }
+}
+
+// picks the checkpoint for --start-at and returns its offset
+static unsigned long long startCheckpoint(const std::vector<RecordIndexEntry> &index) {
+  int i = findCheckpoint(index, StartAtTime, StartAtValue);
+  if (i < 0) {
+    std::cerr << PROG << ": no checkpoint to start at, the recording has "
+              << index.size() << std::endl;
+    exit ( EXIT_FAILURE );
+  }
+  StartCheckpoint = index[i].number;
+  std::cerr << PROG << ": starting at checkpoint " << index[i].number << ", "
+            << index[i].time / 1000.0 << "s into the recording" << std::endl;
+  return index[i].offset;
+}
+
+static void addLine(int index, boost::string_ref view) {
+  static std::string line;
+  Source.push_back(view);
+  line.assign(view.data(), view.size());
+  Program.push_back(Instruction());
+  decodeLine(line, Program.back());
+  noteLabel(index, view);
+}
+
+// jump targets, blocks and tail calls, once every line is there
+static void linkProgram() {
+  int index;
+  for (index = 0; index < SourceNumLines; index++) {
+    resolveInstruction(Program[index]);
+  }
+  matchBlocks();
+  // a Goto that is followed by nothing but a Return is a tail call
+  for (index = 0; index < SourceNumLines; index++) {
+    if (Program[index].op == OP_GOTO || Program[index].op == OP_CALL) {
+      int next = index + 1;
+      while (next < SourceNumLines && 
+             (Program[next].op == OP_ENDIF || Program[next].op == OP_NOP ||
+              Program[next].op == OP_ELSE)) {
+        next = Program[next].op == OP_ELSE ? Program[next].target : next + 1;
+      }
+      Program[index].tail = next < SourceNumLines && Program[next].op == OP_RETURN;
+    }
+  }
+  if (Entry < 0) {
+    // we assume the first line is the entry
+    Entry = 0;
+  }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Compiled scripts and Include. A compiled script is
+ *
+ *   "JAYC", its version and OP_LAST
+ *   hash and size of the script it was made from
+ *   register names: count, then each one
+ *   lines: count, then the text and the Instruction of each one
+ *
+ * The Instructions are as decodeLine left them, jump targets and blocks are
+ * worked out by linkProgram every time, once every included script is in
+ * place. Source points at the text in the mapped compiled script. A compiled
+ * script that doesn't match is simply made again.
+ *
+ * Include puts the lines of another script where it is, its file name is
+ * relative to the script that includes it.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#define JAYC_MAGIC   "JAYC"
+#define JAYC_VERSION 9
+std::list<ScriptMap> Modules;           // included and compiled scripts
+std::vector<std::string> Including;     // what is being loaded, for Include loops
+
+// FNV-1a, the script is mapped already and this is much cheaper than decoding it
+static unsigned long scriptHash(const char * data, size_t size) {
+  unsigned long long h = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; i++) {
+    h ^= (unsigned char)data[i];
+    h *= 1099511628211ULL;
+  }
+  return (unsigned long)h;
+}
+static std::string compiledName(const std::string &fileName, unsigned long hash) {
+  if (CompiledDir != NULL) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016lx.jayc", hash);
+    return CompiledDir + std::string(name);
+  }
+  if (fileName.size() > 4 && fileName.compare(fileName.size() - 4, 4, ".jay") == 0) {
+    return fileName + "c";
+  }
+  return fileName + ".jayc";
+}
+static void saveInstruction(ImageWriter &w, const Instruction &ins) {
+  w.Number(ins.op);
+  w.String(ins.arg);
+  w.String(ins.arg2);
+  w.String(ins.text);
+  w.Signed(ins.x);
+  w.Signed(ins.y);
+  w.Signed(ins.w);
+  w.Signed(ins.h);
+  w.Number(ins.b);
+  w.Signed(ins.ns);
+  w.Number(ins.ks);
+  w.Number(ins.kc);
+  w.Slot(ins.reg);
+  w.Slot(ins.reg2);
+  w.Number(ins.postif);
+  if (ins.postif || ins.op == OP_IF || ins.op == OP_WHILE) {
+    ins.cond.ltoken.Save(w);
+    w.String(ins.cond.comp);
+    ins.cond.rtoken.Save(w);
+    ins.cond.expr.Save(w);
+  }
+  ins.value.Save(w);
+  w.Number(ins.exprs.size());
+  for (size_t i = 0; i < ins.exprs.size(); i++) {
+    ins.exprs[i].Save(w);
+  }
+}
+static void loadInstruction(ImageReader &r, Instruction &ins) {
+  clearInstruction(ins);
+  unsigned long op = r.Number();
+  ins.op = op < OP_LAST ? (OpCode)op : OP_NOP;
+  r.ok = r.ok && op < OP_LAST;
+  r.String(ins.arg);
+  r.String(ins.arg2);
+  r.String(ins.text);
+  ins.x = r.Signed();
+  ins.y = r.Signed();
+  ins.w = r.Signed();
+  ins.h = r.Signed();
+  ins.b = r.Number();
+  ins.ns = r.Signed();
+  ins.ks = r.Number();
+  ins.kc = r.Number();
+  ins.reg = r.Slot();
+  ins.reg2 = r.Slot();
+  ins.postif = r.Number() != 0;
+  if (ins.postif || ins.op == OP_IF || ins.op == OP_WHILE) {
+    ins.cond.ltoken.Load(r);
+    r.String(ins.cond.comp);
+    ins.cond.rtoken.Load(r);
+    ins.cond.expr.Load(r);
+    compilePattern(ins.cond);
+  }
+  ins.value.Load(r);
+  ins.exprs.resize(r.Count());
+  for (size_t i = 0; i < ins.exprs.size() && r.ok; i++) {
+    ins.exprs[i].Load(r);
+  }
+}
+static bool loadCompiled(const std::string &name, unsigned long hash, size_t size,
+                         std::vector<Instruction> &lines,
+                         std::vector<boost::string_ref> &views) {
+  Modules.push_back(ScriptMap());
+  ScriptMap &map = Modules.back();
+  if (!mapFile(name.c_str(), map)) {
+    Modules.pop_back();
+    return false;
+  }
+  ImageReader r;
+  r.p = map.data;
+  r.end = map.data + map.size;
+  r.ok = map.size > 6 && memcmp(r.p, JAYC_MAGIC, 4) == 0 &&
+         r.p[4] == JAYC_VERSION && r.p[5] == OP_LAST;
+  if (r.ok) {
+    r.p += 6;
+    r.ok = r.Number() == hash && r.Number() == size;
+  }
+  if (r.ok) {
+    unsigned long count = r.Count();
+    std::string name;
+    for (unsigned long i = 0; i < count && r.ok; i++) {
+      r.String(name);
+      r.slots.push_back(registerSlot(name));
+    }
+    lines.resize(r.Count());
+    views.reserve(lines.size());
+    for (size_t i = 0; i < lines.size() && r.ok; i++) {
+      views.push_back(r.View());
+      loadInstruction(r, lines[i]);
+    }
+  }
+  if (!r.ok || r.p != r.end) {
+    // out of date, or not one of ours at all
+    lines.clear();
+    views.clear();
+    unmapFile(map);
+    Modules.pop_back();
+    return false;
+  }
+  madvise((void *)map.data, map.size, MADV_NORMAL);
+  return true;
+}
+static void writeCompiled(const std::string &name, unsigned long hash, size_t size,
+                          const std::vector<Instruction> &lines,
+                          const std::vector<boost::string_ref> &views) {
+  ImageWriter body;
+  std::string head(JAYC_MAGIC);
+  head += (char)JAYC_VERSION;
+  head += (char)OP_LAST;
+  body.Number(lines.size());
+  for (size_t i = 0; i < lines.size(); i++) {
+    body.Number(views[i].size());
+    body.out.append(views[i].data(), views[i].size());
+    saveInstruction(body, lines[i]);
+  }
+  // the names of the registers that were used, in the order they were
+  std::vector<const std::string *> names(Registers.size());
+  for (std::map<std::string,int>::iterator it = RegisterSlots.begin(); it != RegisterSlots.end(); it++) {
+    names[it->second] = &it->first;
+  }
+  putVarint(head, hash);
+  putVarint(head, size);
+  putVarint(head, body.order.size());
+  for (size_t i = 0; i < body.order.size(); i++) {
+    putVarint(head, names[body.order[i]]->size());
+    head += *names[body.order[i]];
+  }
+  // written next to it and renamed, so nobody ever loads half of one
+  if (CompiledDir != NULL) {
+    mkdir(CompiledDir, 0777);
+  }
+  std::stringstream tmp;
+  tmp << name << "." << getpid();
+  std::ofstream out(tmp.str().c_str(), std::ios::binary);
+  out.write(head.data(), head.size());
+  out.write(body.out.data(), body.out.size());
+  out.close();
+  if (!out || rename(tmp.str().c_str(), name.c_str()) != 0) {
+    unlink(tmp.str().c_str());
+    return;
+  }
+  CompiledWritten++;
+}
+
+static void includeModule(const std::string &from, const std::string &name);
+static inline bool isInclude(const Instruction &ins) {
+  return ins.op == OP_INCLUDE && !ins.postif;
+}
+
+// puts the lines of a script at the end of Program, and the scripts it includes
+static void appendModule(const std::string &fileName, std::vector<Instruction> &lines,
+                         std::vector<boost::string_ref> &views) {
+  if (Program.empty() && std::find_if(lines.begin(), lines.end(), isInclude) == lines.end()) {
+    // the usual case, one script and nothing to put in between
+    Program.swap(lines);
+    Source.swap(views);
+    for (size_t i = 0; i < Source.size(); i++) {
+      noteLabel(i, Source[i]);
+    }
+    return;
+  }
+  Program.reserve(Program.size() + lines.size());
+  Source.reserve(Source.size() + lines.size());
+  for (size_t i = 0; i < lines.size(); i++) {
+    if (isInclude(lines[i])) {
+      includeModule(fileName, lines[i].arg);
+      continue;
+    }
+    int index = Program.size();
+    Program.push_back(std::move(lines[i]));
+    Source.push_back(views[i]);
+    noteLabel(index, views[i]);
+  }
+}
+static void loadModule(const std::string &fileName, const ScriptMap &map) {
+  std::vector<Instruction> lines;
+  std::vector<boost::string_ref> views;
+  std::string name;
+  unsigned long hash = 0;
+  char * path = realpath(fileName.c_str(), NULL);
+  Including.push_back(path ? path : fileName);
+  free(path);
+  if (Compiled) {
+    hash = scriptHash(map.data, map.size);
+    name = compiledName(fileName, hash);
+    if (loadCompiled(name, hash, map.size, lines, views)) {
+      CompiledLoaded++;
+      appendModule(fileName, lines, views);
+      Including.pop_back();
+      return;
+    }
+  }
+  decodeScript(map, lines, views);
+  if (Compiled) {
+    writeCompiled(name, hash, map.size, lines, views);
+  }
+  appendModule(fileName, lines, views);
+  Including.pop_back();
 }
-std::string doubleToString(double d) {
-  std::stringstream s;
-  s.str("");
-  s << d;
-  return s.str();
+static void includeModule(const std::string &from, const std::string &name) {
+  std::string fileName = name;
+  if (name.empty()) {
+    std::cerr << "Include without a file name" << std::endl;
+    return;
+  }
+  if (name[0] != '/' && from.rfind('/') != std::string::npos) {
+    fileName = from.substr(0, from.rfind('/') + 1) + name;
+  }
+  char * path = realpath(fileName.c_str(), NULL);
+  bool loop = path && std::find(Including.begin(), Including.end(), path) != Including.end();
+  free(path);
+  if (loop) {
+    std::cerr << "Include of a script that is already being included: " << name << std::endl;
+    return;
+  }
+  Modules.push_back(ScriptMap());
+  ScriptMap &map = Modules.back();
+  if (!mapFile(fileName.c_str(), map)) {
+    std::cerr << "Could not open the included script: " << name << std::endl;
+    Modules.pop_back();
+    return;
+  }
+  if (isRecording(map.data, map.size)) {
+    std::cerr << "A recording can't be included: " << name << std::endl;
+    unmapFile(map);
+    Modules.pop_back();
+    return;
+  }
+  loadModule(fileName, map);
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Xlib Helper Functions
+ * Streaming. Lines are decoded as they are read and only the last
+ * StreamWindow of them are kept in StreamLines, Program isn't used at all. Every
+ * _StreamCheckpoint lines the offset in the input is noted, so a jump back
+ * to a line that has left the window seeks to the checkpoint before it and
+ * reads forward from there. A pipe can't seek, so whatever is read from it
+ * is copied into a temporary file as well.
+ *
+ * Labels, entry and block matching are done the first time a line is read.
+ * What matching works out for a line is kept in StreamLinks so it survives
+ * the line leaving the window. A jump to a label that hasn't been read yet,
+ * or a block whose end hasn't, reads ahead until it turns up.
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-Window recursiveWindowSearch(std::string &keywords,Window window,int recurse,int level) {
-  Window root_win, parent_win;
-  unsigned int num_children;
-  Window *child_list;
-  XClassHint classhint;
-  XTextProperty name;
-  int i;
-  if (!XQueryTree(GlobalDisplay, window, &root_win, &parent_win, &child_list, &num_children)) {
-    std::cout << "Recursive returns null to query tree" << std::endl;
-    return NULL;
+struct StreamLink {
+  OpCode op;
+  int target;
+  bool tail;
+};
+struct StreamReader {
+  int in;               // the pipe, -1 when reading a file
+  int fd;               // the file, or the copy of the pipe
+  off_t size;           // bytes copied from the pipe so far
+  bool done;            // every line has been seen
+  bool binary;          // a recording, lines are records then
+  std::string buffer;   // bytes from fd that aren't split into lines yet
+  size_t pos;
+  off_t offset;         // where buffer starts in fd
+  int line;             // number of the next line to be read
+  int high;             // lines below this have been seen before
+  int tail;             // a Goto or call that may turn out to be a tail call
+  long seeks;
+};
+StreamReader Stream;
+std::deque<Instruction> StreamLines;
+int StreamBase = 0;
+struct StreamCheckpoint {
+  off_t offset;
+  int x, y;             // where the motion records of a recording start from
+};
+std::vector<StreamCheckpoint> StreamCheckpoints;
+RecordReader StreamRecords;
+std::unordered_map<int,StreamLink> StreamLinks;
+
+static bool streamOpen(const char * fileName) {
+  struct stat st;
+  int fd = (fileName == NULL || !strcmp(fileName, "-")) ? 0 : open(fileName, O_RDONLY);
+  if (fd < 0) {
+    return false;
   }
-  for (i = (int)num_children - 1; i >= 0; i--) {
-    if (XGetWMName(GlobalDisplay,child_list[i],&name)) {
-      std::cout << "Recursive Search Name: " << name.value << std::endl;
-      std::string s_name = (char *)name.value;
-      if (s_name.find(keywords) != std::string::npos) {
-        std::cout << "Returning found window" << std::endl;
-        return child_list[i];
-      } 
+  Stream.in = -1;
+  Stream.fd = fd;
+  Stream.size = 0;
+  Stream.done = false;
+  Stream.pos = 0;
+  Stream.offset = 0;
+  Stream.line = Stream.high = 0;
+  Stream.tail = -1;
+  Stream.seeks = 0;
+  Stream.binary = false;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    FILE * spool = tmpfile();
+    if (spool == NULL) {
+      return false;
     }
-    Window t;
-    if (t = recursiveWindowSearch(keywords,child_list[i],1,++level)) {
-      return t;
+    Stream.in = fd;
+    Stream.fd = fileno(spool);
+  }
+  return true;
+}
+
+// read some more of the input into buffer, false at the end of it
+static bool streamFill() {
+  char buf[65536];
+  ssize_t n;
+  if (Stream.pos > 0) {
+    Stream.buffer.erase(0, Stream.pos);
+    Stream.offset += Stream.pos;
+    Stream.pos = 0;
+  }
+  off_t at = Stream.offset + Stream.buffer.size();
+  if (Stream.in < 0 || at < Stream.size) {
+    n = pread(Stream.fd, buf, Stream.in < 0 ? sizeof(buf) : std::min((off_t)sizeof(buf), Stream.size - at), at);
+  } else {
+    // the rest may take a while to come, send what we have
+    flushEvents();
+    n = read(Stream.in, buf, sizeof(buf));
+    timelineRestart();
+    if (n > 0) {
+      if (pwrite(Stream.fd, buf, n, Stream.size) != n) {
+        std::cerr << PROG << ": could not copy the script, jumping back may fail" << std::endl;
+      }
+      Stream.size += n;
     }
   }
-  return NULL;
+  if (n <= 0) {
+    return false;
+  }
+  Stream.buffer.append(buf, n);
+  return true;
 }
-Window GetWindowByName(std::string &keywords) {
-  Window window, rootwindow;
-  rootwindow = RootWindow(GlobalDisplay,DefaultScreen(GlobalDisplay));
-  Atom atom = XInternAtom(GlobalDisplay, "_NET_CLIENT_LIST", True);
-  XWindowAttributes attr;
-  Atom atom_event;
-  XEvent xev;
-  Atom actualType;
-  int format;
-  unsigned long numItems, bytesAfter;
-  unsigned char *data = 0;
-  int status = XGetWindowProperty(GlobalDisplay,
-                                  rootwindow,
-                                  atom,
-                                  0L,
-                                  (~0L),
-                                  false,
-                                  AnyPropertyType,
-                                  &actualType,
-                                  &format,
-                                  &numItems,
-                                  &bytesAfter,
-                                  &data);
-  if (status >= Success && numItems) {
-    int * array = (int *)data;
-    for (int k = 0; k < numItems; k++) {
-      window = (Window)array[k];
-      XTextProperty name;
-//       std::cout << "Fetching Name" << std::endl;
-      if (window != NULL) {
-        XGetWMName(GlobalDisplay,window,&name);
-        std::string s_name = (char *)name.value;
-        std::cout << "Name: " << name.value << std::endl;
-        if (s_name.find(keywords) != std::string::npos) {
-          std::cout << "Returning found window" << std::endl;
-          return window;
-        } else {
-          std::cout << "Recursive Search Started" << std::endl;
-          Window t = recursiveWindowSearch(keywords,window,1,1);
-          if (t!= NULL) {
-            return t;
-          }
-        }
-      } else {
-        std::cout << "Window is null" << std::endl;
+
+// the next line that isn't blank or a comment, trimmed
+static bool streamNextLine(boost::string_ref &text) {
+  for (;;) {
+    const char * data = Stream.buffer.data();
+    size_t size = Stream.buffer.size();
+    const char * nl = (const char *)memchr(data + Stream.pos, '\n', size - Stream.pos);
+    if (nl == NULL) {
+      if (streamFill()) {
+        continue;
+      }
+      if (Stream.pos >= Stream.buffer.size()) {
+        return false;
       }
-    } // end for
+      // the last line has no newline
+      nl = data + size;
+    }
+    const char * first = data + Stream.pos;
+    const char * last = nl;
+    Stream.pos = std::min(size, (size_t)(nl - data) + 1);
+    while (first < last && isspace(*first)) first++;
+    while (last > first && isspace(last[-1])) last--;
+    if (first == last || *first == '#') {
+      continue;
+    }
+    text = boost::string_ref(first, last - first);
+    return true;
   }
-  return window;
 }
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * Trim whitespace with an std::string
- * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-// trim from start
-static inline std::string &ltrim(std::string &s) {
-//   std::cout << "ltrim recv: " << s << std::endl;
-  if (s.empty())
-    return s;
-  s.erase(s.begin(), std::find_if(s.begin(), s.end(), std::not1(std::ptr_fun<int, int>(std::isspace))));
-  return s;
+
+// the next record of a recording
+static bool streamNextRecord(RecordEvent &ev) {
+  for (;;) {
+    const char * data = Stream.buffer.data();
+    const char * p = data + Stream.pos;
+    int r = StreamRecords.Next(p, data + Stream.buffer.size(), ev);
+    Stream.pos = p - data;
+    if (r > 0) {
+      return true;
+    }
+    if (r < 0) {
+      std::cerr << PROG << ": recording is damaged at byte "
+                << Stream.offset + Stream.pos << std::endl;
+      return false;
+    }
+    if (!streamFill()) {
+      return false;
+    }
+  }
 }
 
-// trim from end
-static inline std::string &rtrim(std::string &s) {
-//    std::cout << "rtrim recv: " << s << std::endl;
-  if (s.empty())
-    return s;
-  s.erase(std::find_if(s.rbegin(), s.rend(), std::not1(std::ptr_fun<int, int>(std::isspace))).base(), s.end());
-  return s;
+// go back to the checkpoint at or before line
+static void streamSeek(int line) {
+  size_t cp = std::min((size_t)(line / _StreamCheckpoint), StreamCheckpoints.size() - 1);
+  Stream.buffer.clear();
+  Stream.pos = 0;
+  Stream.offset = StreamCheckpoints[cp].offset;
+  StreamRecords.SetPosition(StreamCheckpoints[cp].x, StreamCheckpoints[cp].y);
+  Stream.line = cp * _StreamCheckpoint;
+  Stream.seeks++;
 }
-// trim from both ends
-static inline std::string &trim(std::string &s) {
-//   std::cout << "trying to trim : '" << s << "'" << std::endl;
-  if (s.empty()) {
-//     std::cout << "s is empty: '" << s << "'" << std::endl;
-    return s;
+
+static inline Instruction * residentLine(int line) {
+  if (line >= StreamBase && line < StreamBase + (int)StreamLines.size()) {
+    return &StreamLines[line - StreamBase];
   }
-  return ltrim(rtrim(s));
+  return NULL;
 }
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- *  Parse a string for special characters.
-* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-static inline std::string &parseSpecialChars(std::string &s) {
-  size_t found;
-  found = s.find("\\n");
-  if (found != std::string::npos) {
-    while ((found = s.find("\\n")) != std::string::npos) {
-      s.replace(found,2,"\n");
-    }
+static bool streamRead(Instruction &ins) {
+  static std::string line;
+  boost::string_ref text;
+  RecordEvent ev;
+  bool event = false;
+  int index = Stream.line;
+  if (index == Stream.high && index % _StreamCheckpoint == 0 &&
+      StreamCheckpoints.size() == (size_t)(index / _StreamCheckpoint)) {
+    StreamCheckpoint cp;
+    cp.offset = Stream.offset + Stream.pos;
+    StreamRecords.Position(cp.x, cp.y);
+    StreamCheckpoints.push_back(cp);
   }
-  found = s.find("\\t");
-  if (found != std::string::npos) {
-    while ((found = s.find("\\t")) != std::string::npos) {
-      s.replace(found,2,"\t");
+  bool more;
+  if (Stream.binary) {
+    more = streamNextRecord(ev);
+    if (more && ev.type == REC_TEXT) {
+      text = boost::string_ref(ev.text, ev.length);
+    } else {
+      event = more;
     }
+  } else {
+    more = streamNextLine(text);
   }
-  found = s.find("\\r");
-  if (found != std::string::npos) {
-    while ((found = s.find("\\r")) != std::string::npos) {
-      s.replace(found,2,"\r");
+  if (!more) {
+    if (!Stream.done) {
+      Stream.done = true;
+      SourceNumLines = Stream.high;
+      finishBlocks();
     }
+    return false;
   }
-  found = s.find("0x");
-  if (found != std::string::npos) {
-    while ((found = s.find("0x")) != std::string::npos) {
-      size_t end = s.find(" ",found);
-      std::string sub = s.substr(found,4);
-      std::stringstream ss(sub);
-      uint32_t v;
-      ss >> std::setbase(0) >> v;
-      char str[1];
-      sprintf(str,"%c",v);
-      s.replace(found,sub.size(),str,1);
-    }
+  if (event) {
+    eventInstruction(ev, ins);
+  } else {
+    line.assign(text.data(), text.size());
+    decodeLine(line, ins);
   }
-  found = s.find("${");
-  if (found != std::string::npos) {
-    while ((found = s.find("${")) != std::string::npos) {
-      size_t end = s.find("}",found);
-      std::string sub = s.substr(found + 2,end - found - 2);
-      s.replace(found,sub.size() + 3, Registers[sub].c_str(),Registers[sub].size());
+  Stream.line++;
+  if (index < Stream.high) {
+    // seen it before, put back what matching worked out
+    std::unordered_map<int,StreamLink>::iterator it = StreamLinks.find(index);
+    if (it != StreamLinks.end()) {
+      ins.op = it->second.op;
+      ins.tail = it->second.tail;
+      if (it->second.target >= 0) {
+        ins.target = it->second.target;
+      }
+    }
+  } else {
+    Stream.high++;
+    noteLabel(index, text);
+    OpCode op = ins.op;
+    matchLine(index, ins, text);
+    if (Stream.tail >= 0) {
+      if (ins.op == OP_RETURN) {
+        StreamLinks[Stream.tail].tail = true;
+        if (Instruction * call = residentLine(Stream.tail)) {
+          call->tail = true;
+        }
+      }
+      if (ins.op != OP_ENDIF && ins.op != OP_NOP) {
+        Stream.tail = -1;
+      }
+    }
+    switch (op) {
+      case OP_GOTO:
+      case OP_CALL:
+        Stream.tail = index;
+        // fall through, it is kept like the rest
+      case OP_IF:
+      case OP_ELSE:
+      case OP_FOR:
+      case OP_NEXT:
+      case OP_WHILE:
+      case OP_WEND:
+      case OP_BREAK:
+      case OP_CONTINUE:
+        {
+          StreamLink link;
+          link.op = ins.op;
+          link.target = ins.target;
+          link.tail = false;
+          StreamLinks[index] = link;
+        }
+        break;
+      default:
+        break;
     }
   }
-  double n;
-  if (Parser::result(s.begin(),s.end(),n)) {
-    std::stringstream ss;
-    ss.str("");
-    ss << n;
-    s = ss.str();
-  }
-  return s;
-}
-static inline void saveRegexResult(boost::smatch &what) {
-    int i;
-    std::stringstream sind;
-    for(i = 0; i < what.size(); ++i) {
-      sind << i;
-      Registers[sind.str()] = what[i];
-      sind.str("");
+  if (ins.op == OP_GOTO || ins.op == OP_CALL) {
+    std::map<std::string,int>::iterator it = Labels.find(ins.arg);
+    if (it != Labels.end()) {
+      ins.target = it->second;
     }
-      
+  }
+  return true;
 }
-static inline bool isPostIf(std::string &str) {
-  boost::regex expr("(.*) if (.*)");
-  boost::smatch what;
-  if (boost::regex_match(str,what,expr)) {
-    
-    boost::regex expr2("(.*) (is|not|like) (.*)");
-    boost::smatch what2;
-    
-    std::stringstream line;
-    std::string nstr = what[2];
-    
-
-    boost::regex_match(nstr,what2,expr2);
-
-    line.str(nstr);
-    std::string ltoken,comp,rtoken;
-    ltoken = what2[1];
-    comp = what2[2];
-    rtoken = what2[3];
-    ltoken = parseSpecialChars(ltoken);
-    rtoken = parseSpecialChars(rtoken);
-    bool istrue = expressionResult(ltoken,comp,rtoken);
-    if (istrue) {
-      std::string x = what[1];
-//       std::cout << "is true, executing line: " << x << std::endl;
-      executeLine(x);
+
+// read one more line ahead of the window, without letting it grow too big
+static bool streamScan() {
+  static Instruction scratch;
+  if (Stream.done) {
+    return false;
+  }
+  if (Stream.line == StreamBase + (int)StreamLines.size() && (int)StreamLines.size() < StreamWindow) {
+    StreamLines.push_back(Instruction());
+    if (!streamRead(StreamLines.back())) {
+      StreamLines.pop_back();
+      return false;
     }
     return true;
   }
-  return false;
-}
-static inline bool expressionResult(std::string &ltoken, 
-                                    std::string &comp, 
-                                    std::string & rtoken)
-{
-//      std::cout << "(" << ltoken << " " << comp << " " << rtoken << ")" << std::endl;
-    if (comp == "is" && ltoken == rtoken)
-      return true;
-    if (comp == "not" && ltoken != rtoken)
-      return true;
-    if (comp == "like") {
-      // we have to use a regular expression, which should be rtoken
-      boost::regex expr(rtoken);
-      boost::smatch what;
-      if (boost::regex_match(ltoken,what,expr)) {
-        saveRegexResult(what);
-        return true;
-      }
-    }
-    return false;
+  if (Stream.line < Stream.high - _StreamCheckpoint) {
+    // nothing new to learn before high
+    streamSeek(Stream.high);
+  }
+  return streamRead(scratch);
 }
 
-static inline void executeIf(std::string &sline) {
-    std::stringstream line;
-    line.str(sline);
-    std::string ltoken,comp,rtoken;
-    bool istrue = false;
-    line >> ltoken;
-    line >> ltoken >> comp >> rtoken;
-    ltoken = parseSpecialChars(ltoken);
-    rtoken = parseSpecialChars(rtoken);
-    //std::cout << "Tokens: " << ltoken << " " << rtoken << std::endl;
-    istrue = expressionResult(ltoken,comp,rtoken);
-    if (istrue) {
-      Index++;
-      while(Source[Index].find("endif") == std::string::npos) {
-        executeLine(Source[Index]);
-        Index++;
-      }
-      return;
-    } else {
-      while(Source[Index].find("endif") == std::string::npos) {
-        Index++;
-      }
+static Instruction * streamLine(int n) {
+  Instruction * ins = residentLine(n);
+  if (ins) {
+    return ins;
+  }
+  if (Stream.done && n >= SourceNumLines) {
+    return NULL;
+  }
+  if (Stream.line != StreamBase + (int)StreamLines.size() || n < StreamBase) {
+    if (n < Stream.line) {
+      streamSeek(n);
     }
-
+    StreamLines.clear();
+    StreamBase = Stream.line;
+  }
+  while (StreamBase + (int)StreamLines.size() <= n) {
+    StreamLines.push_back(Instruction());
+    if (!streamRead(StreamLines.back())) {
+      StreamLines.pop_back();
+      return NULL;
+    }
+    if ((int)StreamLines.size() > StreamWindow) {
+      StreamLines.pop_front();
+      StreamBase++;
+    }
+  }
+  return &StreamLines.back();
 }
 
-static inline void executeLine(std::string &sline) {
-    std::stringstream myfile;
-    char ev[200], str[1024], reg[1];
-    int x, y,entry,ret;
-    unsigned int b;
-    KeySym ks;
-    KeyCode kc;
+// a label that hasn't been read yet, Goto and calls only
+static void streamFindLabel(Instruction &ins) {
+  while (Labels.find(ins.arg) == Labels.end() && streamScan()) {
+  }
+  resolveInstruction(ins);
+}
 
-    myfile << sline;
-	  myfile >> ev;
-//      std::cout << "\t\t\t\t\t\tev: " << ev << std::endl;
-	  char * nev = trimWhitespace(ev);
-	  strcpy(ev,nev);
-	  if (ev[0]=='#')
-	  {
-	    std::cout << "Comment: " << ev << std::endl;
-      return;
-	  }
-	  else if (!strcasecmp("End",ev))
-	  {
-	    exit(0);
-	  }
-    else if (!strcasecmp("EndL",ev))
-	  {
-      std::cout << std::endl;
-	  }
+// where a block ends may not have been read yet
+static int streamBlockTarget(Instruction &ins) {
+  while (ins.target < 0 && streamScan()) {
+  }
+  return ins.target;
+}
 
-	  else if (!strcasecmp("Set",ev))
-	  {
-      std::string reg;
-      std::string value;
-      myfile >> reg;
-      if (reg.find("++") != std::string::npos) {
-          reg = reg.replace(reg.find("++"),2,"");
-          double d = stringToDouble(Registers[reg]);
-          d++;
-          Registers[reg] = doubleToString( d );
-      } else if (reg.find("--") != std::string::npos) {
-          reg = reg.replace(reg.find("--"),2,"");
-          double d = stringToDouble(Registers[reg]);
-          d--;
-          Registers[reg] = doubleToString( d );
-      } else {
-          myfile.getline(str,1024);
-          value = str;
-	        Registers[reg] = parseSpecialChars(trim(value));
-      }
-	  }
-    else if (!strcasecmp("FileOpen",ev))
-	  {
-      std::string vname;
-      std::string fpath;
-      myfile >> vname;
-      myfile.getline(str,1024);
-      fpath = str;
-      file_object ff;
-      file_object * fob;
-      fob = &ff;
-      fpath = trim(parseSpecialChars(fpath));
-      fob->name = stringToCharz(fpath);
-      std::ifstream f(fpath.c_str());
-      f.seekg(0, std::ios::end);
-      fob->length = f.tellg();
-      f.seekg(0,std::ios::beg);
-      fob->cpos = f.tellg();
-      f.close();
-      OpenFiles[vname] = fob; 
-	  }
-    else if (!strcasecmp("FileReadAll",ev))
-	  {
-      std::string desc;
-      std::string target;
-      myfile >> desc;
-      myfile >> target;
-      std::ifstream f(OpenFiles[desc]->name);
-      std::string str((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
-      Registers[target] = str;
-      f.close();
-	  }
-    else if (!strcasecmp("FileLength",ev))
-	  {
-      std::string desc;
-      std::string target;
-      myfile >> desc;
-      myfile >> target;
-	    int length;
-      std::stringstream s;
-      s << OpenFiles[desc]->length;
-      Registers[target] = s.str();
-	  }
-    else if (!strcasecmp("In",ev))
-	  {
-      std::string reg;
-      std::string value;
-      myfile >> reg;
-      myfile.getline(str,1024);
-      std::cout << trimWhitespace(str) << " ";
-      std::cin >> value;
-	    Registers[reg] = trim(value);
-	  }
-    else if (!strcasecmp("If",ev))
-	  {
-      executeIf(Source[Index]);
-	  }
+static void setTarget(int line, int target) {
+  if (!Streaming) {
+    Program[line].target = target;
+    return;
+  }
+  StreamLinks[line].target = target;
+  if (Instruction * ins = residentLine(line)) {
+    ins->target = target;
+  }
+}
 
-	  else if (!strcasecmp("Preg",ev))
-	  {
-	    myfile >> str;
-	    std::string s = str;
-      std::cout << Registers[s] << std::endl;
-	  }
-	  else if (!strcasecmp("Delay",ev))
-	  {
-	    myfile >> b;
-	    std::cout << "Delay: " << b << std::endl;
-	    sleep ( b );
-	  }
-	  else if (!strcasecmp("SetMouseDelay",ev))
-    {
-      myfile >> b;
-      std::cout << "Delay: " << b << std::endl;
-      MouseDelay = b;
-    }
-    else if (!strcasecmp("SetKeyPressDelay",ev))
-    {
-      myfile >> b;
-      std::cout << "Delay: " << b << std::endl;
-      KeyPressDelay = b;
-    }
-	  else if (!strcasecmp("USleep",ev))
-	  {
-	    myfile >> b;
-	    std::cout << "USleep: " << b << std::endl;
-	    usleep ( b );
-	  }
-	  else if (!strcasecmp("Print",ev))
-	  {
-      std::string text;
-	    myfile.getline(str,1024);
-      text = str;
-	    std::cout << parseSpecialChars(trim(text));
-	  }
-	  else if (!strcasecmp("Restart",ev))
-	  {
-	    myfile.seekg(0);
-	  }
-	  else if (!strcasecmp("Return",ev))
-	  {
-      //std::cout << "Returning" << std::endl;
-      CallStackPtr--;
-      if (CallStackPtr < 0) {
-        CallStackPtr = 0;
-      }
-	    Index = CallStack[CallStackPtr];
-      executeLine(Source[Index]);
-	  }
-    else if (!strcasecmp("Break",ev))
-	  {
-      std::string scs = "SCS";
-      Index = atoi(Registers[scs].c_str()) ; 
-		  CallStackPtr = 0;  
-      executeLine(Source[Index]);
-    }
-
-	  else if (!strcasecmp("Goto",ev))
-	  {
-      myfile >> str;
-	    CallStack[CallStackPtr] = ++Index;
-      if (CallStackPtr == 0) {
-        std::stringstream s;
-        s << Index;
-        Registers["SCS"] = s.str(); 
-      }
-	    CallStackPtr++;
-      if (CallStackPtr > _StackDepth) {
-		    std::cout << "Call Stack Too Deep!";
-		    exit(-1);
-	    }
-      std::string token;
-      token = str;
-      Index = Labels[trim(token)];
-      executeLine(Source[Index]);
-	  }
-	  else if (!strcasecmp("ButtonPress",ev))
-	  {
-	    myfile >> b;
-	    std::cout << "ButtonPress: " << b << std::endl;
-	    XTestFakeButtonEvent ( GlobalDisplay, b, True, Delay );
-	  }
-	  else if (!strcasecmp("Down",ev))
-	  {
-	    b = 1;
-	    std::cout << "Down: " << b << std::endl;
-	    XTestFakeButtonEvent ( GlobalDisplay, b, True, Delay );
-	  }
-	  else if (!strcasecmp("click",ev))
-	  {
-	    b = 1;
-	    XTestFakeButtonEvent ( GlobalDisplay, b, True, Delay );
-	    XFlush ( GlobalDisplay );
-	    usleep(200000);
-	    XTestFakeButtonEvent ( GlobalDisplay, b, False, Delay );
-	  }
-	  else if (!strcasecmp("ButtonRelease",ev))
-	  {
-	    myfile >> b;
-	    std::cout << "ButtonRelease: " << b << std::endl;
-	    XTestFakeButtonEvent ( GlobalDisplay, b, False, Delay );
-	  }
-	  else if (!strcasecmp("Up",ev))
-	  {
-	    b = 1;
-	    std::cout << "Up: " << b << std::endl;
-	    XTestFakeButtonEvent ( GlobalDisplay, b, False, Delay );
-	  }
-	  else if (!strcasecmp("Move",ev))
-	  {
-	    myfile >> x >> y;
-	    std::cout << "Move: " << x << " " << y << std::endl;
-	    XTestFakeMotionEvent ( GlobalDisplay, GlobalScreen , scale ( x ), scale ( y ), MouseDelay ); 
-	  }
-	  else if (!strcasecmp("RelativeMove",ev))
-    {
-      myfile >> x >> y;
-      std::cout << "Move: " << x << " " << y << std::endl;
-      XTestFakeRelativeMotionEvent ( GlobalDisplay, scale ( x ), scale ( y ), MouseDelay ); 
-    }
-	  else if (!strcasecmp("MotionNotify",ev) || !strcasecmp("Move",ev))
-	  {
-	    myfile >> x >> y;
-	    std::cout << "MotionNotify: " << x << " " << y << std::endl;
-	    XTestFakeMotionEvent ( GlobalDisplay, GlobalScreen , scale ( x ), scale ( y ), MouseDelay ); 
-	  }
-	  else if (!strcasecmp("KeyCodePress",ev))
-	  {
-	    myfile >> kc;
-	    std::cout << "KeyPress: " << kc << std::endl;
-	    XTestFakeKeyEvent ( GlobalDisplay, kc, True, KeyPressDelay );
-	  }
-	  else if (!strcasecmp("KeyCodeRelease",ev))
-	  {
-	    myfile >> kc;
-	    std::cout << "KeyRelease: " << kc << std::endl;
-    	  XTestFakeKeyEvent ( GlobalDisplay, kc, False, KeyPressDelay );
-	  }
-	  else if (!strcasecmp("KeySym",ev))
-	  {
-	    myfile >> ks;
-	    std::cout << "KeySym: " << ks << std::endl;
-	    if ( ( kc = XKeysymToKeycode ( GlobalDisplay, ks ) ) == 0 )
-	    {
-	    	std::cerr << "No keycode on remote display found for keysym: " << ks << std::endl;
-        return;
-	    }
-	    XTestFakeKeyEvent ( GlobalDisplay, kc, True, KeyPressDelay );
-	    XFlush ( GlobalDisplay );
-	    XTestFakeKeyEvent ( GlobalDisplay, kc, False, Delay );
-	  }
-	  else if (!strcasecmp("KeySymPress",ev))
-	  {
-	    myfile >> ks;
-	    std::cout << "KeySymPress: " << ks << std::endl;
-	    if ( ( kc = XKeysymToKeycode ( GlobalDisplay, ks ) ) == 0 )
-	    {
-	    	std::cerr << "No keycode on remote display found for keysym: " << ks << std::endl;
-        return;
-	    }
-	    XTestFakeKeyEvent ( GlobalDisplay, kc, True, KeyPressDelay );
-	  }
-	  else if (!strcasecmp("KeySymRelease",ev))
-	  {
-	    myfile >> ks;
-	    std::cout << "KeySymRelease: " << ks << std::endl;
-	    if ( ( kc = XKeysymToKeycode ( GlobalDisplay, ks ) ) == 0 )
-	    {
-	    	std::cerr << "No keycode on remote display found for keysym: " << ks << std::endl;
-        return;
-	    }
-    	  XTestFakeKeyEvent ( GlobalDisplay, kc, False, KeyPressDelay );
-	  }
-	  else if (!strcasecmp("KeyStr",ev))
-	  {
-	    myfile >> ev;
-	    std::cout << "KeyStr: " << ev << std::endl;
-	    ks=XStringToKeysym(ev);
-	    if ( ( kc = XKeysymToKeycode ( GlobalDisplay, ks ) ) == 0 )
-	    {
-	    	std::cerr << "No keycode on remote display found for '" << ev << "': " << ks << std::endl;
-        return;
-	    }
-	    XTestFakeKeyEvent ( GlobalDisplay, kc, True, KeyPressDelay );
-	    XFlush ( GlobalDisplay );
-	    XTestFakeKeyEvent ( GlobalDisplay, kc, False, KeyPressDelay );
-	  }
-	  else if (!strcasecmp("KeyStrPress",ev))
-	  {
-	    myfile >> ev;
-	    std::cout << "KeyStrPress: " << ev << std::endl;
-	    ks=XStringToKeysym(ev);
-	    if ( ( kc = XKeysymToKeycode ( GlobalDisplay, ks ) ) == 0 )
-	    {
-	    	std::cerr << "No keycode on remote display found for '" << ev << "': " << ks << std::endl;
-        return;
-	    }
-	    XTestFakeKeyEvent ( GlobalDisplay, kc, True, KeyPressDelay );
-	  }
-	  else if (!strcasecmp("KeyStrRelease",ev))
-	  {
-	    myfile >> ev;
-	    std::cout << "KeyStrRelease: " << ev << std::endl;
-	    ks=XStringToKeysym(ev);
-	    if ( ( kc = XKeysymToKeycode ( GlobalDisplay, ks ) ) == 0 )
-	    {
-	    	std::cerr << "No keycode on remote display found for '" << ev << "': " << ks << std::endl;
-        return;
-	    }
-    	  XTestFakeKeyEvent ( GlobalDisplay, kc, False, KeyPressDelay );
-	  }
-	  else if (!strcasecmp("Send",ev))
-	  {
-	    myfile.ignore().get(str,1024);
-	    b=0;
-	    while(str[b]) sendChar(GlobalDisplay, str[b++]);
-	  }
-	  else if (!strcasecmp("Exec",ev))
-	  {
-	    myfile.ignore().get(str,1024);
-	    pid_t cpid;
-      cpid = fork();
-      if (cpid==0) {
-	      system(str);
-	      exit(0);
-	    } else {
-        
+// move to the checkpoint --start-at asks for, before anything is read
+static void streamStartAt() {
+  std::vector<RecordIndexEntry> index;
+  unsigned long long at = 0;
+  struct stat st;
+  bool found = false;
+  if (!Stream.binary) {
+    std::cerr << PROG << ": --start-at needs a binary recording" << std::endl;
+    exit ( EXIT_FAILURE );
+  }
+  if (Stream.in < 0 && fstat(Stream.fd, &st) == 0 && st.st_size > JAYREC_HEADER + JAYREC_TRAILER) {
+    // a finished recording has its index at the end, the trailer says where
+    std::string tail(JAYREC_TRAILER, 0);
+    off_t from = st.st_size - JAYREC_TRAILER;
+    if (pread(Stream.fd, &tail[0], tail.size(), from) == (ssize_t)tail.size()) {
+      findIndex(tail.data(), tail.size(), from, index, at);
+      if (at >= JAYREC_HEADER && at < (unsigned long long)from) {
+        tail.resize(st.st_size - at);
+        found = pread(Stream.fd, &tail[0], tail.size(), at) == (ssize_t)tail.size() &&
+                findIndex(tail.data(), tail.size(), at, index, at);
       }
-	  }
-	  else if (!strcasecmp("MoveWindow",ev))
-    {
-      boost::regex expr("'(.*)',([\\s\\d]+),([\\s\\d]+)");
-      boost::smatch what;
-      myfile.ignore().get(str,1024);
-      std::string s_str = trimWhitespace(str);
-      if (boost::regex_match(s_str,what,expr)) {
-        int x = stringToInt(what[2]);
-        int y = stringToInt(what[3]);
-        std::string name = what[1];
-        std::cout << "MoveWindow " << name << " " << x << " " << y << std::endl;
-        Window w = GetWindowByName(name);
-      } //end if regex match
-      
     }
-	  else if (!strcasecmp("Focus",ev))
-	  {
-	    myfile.ignore().get(str,1024);
-	    std::string s_str = trimWhitespace(str);
-	    if (s_str.length() < 3) {
-        return;
-	    }
-	    std::cout << "Focus: " << str << std::endl;
-	    Window window, rootwindow;
-      rootwindow = RootWindow(GlobalDisplay,DefaultScreen(GlobalDisplay));
-      Atom atom = XInternAtom(GlobalDisplay, "_NET_CLIENT_LIST", True);
-      XWindowAttributes attr;
-      Atom atom_event;
-      XEvent xev;
-      Atom actualType;
-      int format;
-      unsigned long numItems, bytesAfter;
-      unsigned char *data = 0;
-      int status = XGetWindowProperty(GlobalDisplay,
-                                      rootwindow,
-                                      atom,
-                                      0L,
-                                      (~0L),
-                                      false,
-                                      AnyPropertyType,
-                                      &actualType,
-                                      &format,
-                                      &numItems,
-                                      &bytesAfter,
-                                      &data);
-      if (status >= Success && numItems) {
-        std::cout << "Yay";
-        int * array = (int *)data;
-        for (int k = 0; k < numItems; k++) {
-          window = (Window)array[k];
-          char * name;
-          XFetchName(GlobalDisplay,window,&name);
-          if (name) {
-            std::string s_name = name;
-            if (s_name.find(s_str) != std::string::npos) {
-              std::cout << "Raising Window";
-              atom_event = XInternAtom (GlobalDisplay, "_NET_ACTIVE_WINDOW", False);
-              xev.xclient.type = ClientMessage;
-              xev.xclient.serial = 0;
-              xev.xclient.send_event = True;
-              xev.xclient.display = GlobalDisplay;
-              xev.xclient.window = window;
-              xev.xclient.message_type = atom_event;
-              xev.xclient.format = 32;
-              xev.xclient.data.l[0] = 2;
-              xev.xclient.data.l[1] = 0;
-              xev.xclient.data.l[2] = 0;
-              xev.xclient.data.l[3] = 0;
-              xev.xclient.data.l[4] = 0;
-              XGetWindowAttributes(GlobalDisplay, window, &attr);
-              XSendEvent (GlobalDisplay,
-                          attr.root, False,
-                          SubstructureRedirectMask | SubstructureNotifyMask,
-                          &xev);
-              XRaiseWindow(GlobalDisplay,window);
-              XFlush ( GlobalDisplay );
-            }
-          }
+  }
+  if (!found) {
+    // read through for the checkpoints, a pipe can come back through its copy
+    RecordEvent ev;
+    off_t start = Stream.offset + Stream.pos;
+    index.clear();
+    while (streamNextRecord(ev)) {
+      if (ev.type == REC_CHECKPOINT) {
+        RecordIndexEntry entry = { ev.checkpoint.number, ev.checkpoint.time,
+                                   (unsigned long long)start };
+        if ((StartAtTime ? entry.time : entry.number) > StartAtValue) {
+          break;
         }
-      } else {
-        std::cout << "Failed...";
-      }
-	  } else if (ev[0]!=0) {
-      std::string token = ev;
-      if ( Labels[trim(token)] ) {
-        CallStack[CallStackPtr] = ++Index;
-        if (CallStackPtr == 0) {
-          std::stringstream s;
-          s << Index;
-          Registers["SCS"] = s.str(); 
-        }
-        CallStackPtr++;
-        if (CallStackPtr > _StackDepth) {
-          std::cout << "Call Stack Too Deep!";
-          exit(-1);
-        }
-        Index = Labels[trim(token)];
-        executeLine(Source[Index]);
+        index.push_back(entry);
       }
+      start = Stream.offset + Stream.pos;
     }
-
-	  // sync the remote server
-	  XFlush ( GlobalDisplay );
-    myfile.clear();
-
+  }
+  Stream.buffer.clear();
+  Stream.pos = 0;
+  Stream.offset = startCheckpoint(index);
 }
-/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
- * We need to have the entire file as a logical structure instead of just
- * a stream of bits because we need to move back and forth in the file and
- * using tellg just isn't cutting it. 
- * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-void parseFileIntoStruct(char * fileName) {
-//   std::cout << "fileName is : " << fileName;
-  std::string line;
-  std::ifstream file (fileName);
-  std::string token;
-  std::stringstream ss;
-  int index = 0;
-  while( getline(file,line) ) {
-//     std::cout << "CURRENT LINE IS: " << line << std::endl;
-    trim(line);
-//     std::cout << "trimmed line is: " << line << std::endl;
-    if (line.empty() || line == "" || line.substr(0,1) == "#") {
-//       std::cout << " line is blank" << std::endl;
-      continue;
-    } else {
-//       std::cout << " line is not blank" << std::endl;
-    }
-//     std::cout << index << " > " << _SourceLines << std::endl;
-    if (index >= _SourceLines) {
-//       std::cout << "Calculating new lines" << std::endl;
-      int _NewSourceLines = _SourceLines + floor(_SourceLines * 0.33);
-//       std::cout << "new sl " << _NewSourceLines << std::endl;
-      std::string * NewSource = new std::string[_NewSourceLines];
-      memcpy(NewSource,Source,_SourceLines * sizeof(std::string));
-      Source = NewSource;
-      _SourceLines = _NewSourceLines;
-    } else {
-//       std::cout << "no need to resize" << std::endl;
-    }
-//     std::cout << " setting line " << std::endl;
-    Source[index] = line;
-//     std::cout << " line set " << std::endl;
-    // Now let's look at the string and find out some stuff about it
-//     std::cout << "setting ss" << std::endl;
-    ss.str(line);
-//     std::cout << "reading token" << std::endl;
-    ss >> token;
-//     std::cout << "token read" << std::endl;
-    if (!token.empty() && token.length() > 2) {
-//       std::cout << "token is not empty " << token << token.length() << std::endl;
-      token = trim(token);
-      if (token == "label" || token == "function") {
-        ss >> token;
-        Labels[token] = index + 1; // i.e. we goto the declaration line + 1
-      } else if (token == "entry" || token == "main") {
-        Entry = index;
-      }
-//       std::cout << "token looking complete" << std::endl;
-    } else {
-//       std::cout << "token was empty" << std::endl;
-    }
-    ss.clear();
-    index++;
+
+void streamFileIntoLines(char * fileName) {
+  SCSSlot = registerSlot("SCS");
+  if (!streamOpen(fileName)) {
+    std::cerr << PROG << ": could not open " << (fileName ? fileName : "stdin") << std::endl;
+    exit ( EXIT_FAILURE );
   }
-//   std::cout << "done parsing file" << std::endl;
-  SourceNumLines = index;
-  if (Entry == NULL) {
-    // we assume the first line is the entry
-    Entry = 0;
+  // a recording or a script
+  while (Stream.buffer.size() < JAYREC_HEADER && streamFill()) {
+  }
+  Stream.binary = isRecording(Stream.buffer.data(), Stream.buffer.size());
+  if (Stream.binary) {
+    Stream.pos = JAYREC_HEADER;
+  }
+  if (StartAt) {
+    streamStartAt();
+  }
+  Entry = 0;
+  Instruction * first = streamLine(0);
+  if (first && first->op == OP_LABEL) {
+    // functions come first, entry is somewhere after them
+    Entry = -1;
+    while (Entry < 0 && streamScan()) {
+    }
+    if (Entry < 0) {
+      Entry = 0;
+    }
   }
 }
 
@@ -1244,18 +5678,90 @@ void parseFileIntoStruct(char * fileName) {
 
 void eventLoop (Display * RemoteDpy, int RemoteScreen,char * filename) {
 //   std::cout << "eventLoop beginning with filename " << filename << std::endl;
-  parseFileIntoStruct(filename);
+  if (Streaming) {
+    streamFileIntoLines(filename);
+  } else {
+    parseFileIntoStruct(filename);
+  }
   GlobalDisplay = RemoteDpy;
   GlobalScreen = RemoteScreen;
-  for ( Index = Entry; Index <= SourceNumLines; Index++ ) {
+  // drawing is only reported from when the damage object exists, so it is
+  // made before the first line runs, a streamed script makes it when it
+  // gets to the first wait
+  for (int i = 0; i < SourceNumLines && !Streaming && !Painted.ready; i++) {
+    if (Program[i].op == OP_WAITIDLE || Program[i].op == OP_WAITCHANGE) {
+      damageInit(RemoteDpy);
+    }
+  }
+  // Index always points at the next line to run, jumps simply overwrite it
+  Index = Entry;
+  while ( Index >= 0 ) {
+    int line = Index++;
     //usleep(500000);
-//     std::cout << "\t\t\t\t\tLine: " << Source[Index] << std::endl;
-    if (isPostIf(Source[Index])) {
-      //do nothing
-    } else {
-        executeLine(Source[Index]);
+//     std::cout << "\t\t\t\t\tLine: " << Source[line] << std::endl;
+    Instruction * ins = programLine(line);
+    if (ins == NULL) {
+      break;
+    }
+    flushLate();
+    if (FrameStopping) {
+      // the frame thread ends jayplay once the frames are written, the
+      // signals are blocked here so this sleeps until then
+      while (true) {
+        pause();
+      }
+    }
+    if (ins->postif && !conditionResult(ins->cond)) {
+      continue;
     }
-  } // end for index 
+    executeInstruction(*ins);
+  } // end while index 
+}
+
+
+/****************************************************************************/
+/*! Prints statistics about the run to stderr. Registered with atexit, since
+    End leaves through exit().
+*/
+/****************************************************************************/
+void printStatistics () {
+
+  if ( LikePatterns.hits || LikePatterns.misses ) {
+	std::cerr << PROG << ": like pattern cache: " << LikePatterns.hits << " hits, "
+		 << LikePatterns.misses << " misses." << std::endl;
+  }
+  if ( Streaming ) {
+	std::cerr << PROG << ": streamed " << Stream.high << " lines, "
+		 << Stream.seeks << " seeks back." << std::endl;
+  }
+  if ( Injected ) {
+	std::cerr << PROG << ": " << Injected << " fake events in " << Flushes << " writes";
+	if ( XTestErrors ) {
+	  std::cerr << ", " << XTestErrors << " failed";
+	}
+	std::cerr << "." << std::endl;
+  }
+  if ( Waits ) {
+	std::cerr << PROG << ": " << Waits << " waits, woke up " << std::fixed << std::setprecision(3)
+		 << Lateness / 1e6 / Waits << "ms late on average, " << MaxLateness / 1e6
+		 << "ms at most." << std::endl;
+  }
+  if ( MotionSeen ) {
+	std::cerr << PROG << ": " << MotionDropped << " of " << MotionSeen
+		 << " motion events left out." << std::endl;
+  }
+  if ( IdleCut ) {
+	std::cerr << PROG << ": " << IdleCut << " pauses cut to " << IdleLimit / 1000000
+		 << "ms." << std::endl;
+  }
+  if ( Frames.grabbed ) {
+	std::cerr << PROG << ": " << Frames.grabbed << " frames grabbed, " << Frames.stored / Frames.grabbed / 1024
+		 << "kB a frame." << std::endl;
+  }
+  if ( Compiled && ! Streaming ) {
+	std::cerr << PROG << ": compiled scripts: " << CompiledLoaded << " loaded, "
+		 << CompiledWritten << " written." << std::endl;
+  }
 }
 
 
@@ -1270,20 +5776,39 @@ int main (int argc, char * argv[]) {
 
   // parse commandline arguments
   parseCommandLine ( argc, argv );
+
+  // the frame ring grabs the screen on a thread of its own
+  if ( FrameRate > 0 ) {
+	XInitThreads ( );
+  }
   
   // open the remote display or abort
   Display * RemoteDpy = remoteDisplay ( Remote );
 
   // get the screens too
   int RemoteScreen = DefaultScreen ( RemoteDpy );
-  
+
+  if ( FramebufferName != NULL && ! fbOpen ( FramebufferName ) ) {
+	std::cerr << PROG << ": the screen is read from the server instead." << std::endl;
+  }
   XTestDiscard ( RemoteDpy );
 
+  atexit ( printStatistics );
+  // whatever is still queued when End or an error leaves
+  atexit ( flushEvents );
+
+  // after the handlers above, so its own one stops the thread before they run
+  if ( FrameRate > 0 ) {
+	frameStart ( Remote );
+  }
+
   // start the main event loop
 //   std::cout << "Starting main loop" << std::endl;
-  eventLoop ( RemoteDpy, RemoteScreen, argv[2] );
+  eventLoop ( RemoteDpy, RemoteScreen, ScriptName );
 
-  // discard and even flush all events on the remote display
+  // send what is queued, then discard and even flush all events on the
+  // remote display
+  flushEvents ( );
   XTestDiscard ( RemoteDpy );
   XFlush ( RemoteDpy ); 
 
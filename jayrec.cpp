@@ -53,6 +53,8 @@
  ****************************************************************************/
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
+#include "jayrecord.h"
 
 #define PROG "xmacrorec2"
 
@@ -79,6 +81,39 @@ float Scale = DefaultScale;
 unsigned int QuitKey;
 bool HasQuitKey = false;
 
+/***************************************************************************** 
+ * Write a binary recording (see jayrecord.h) instead of text.
+ ****************************************************************************/
+bool Binary = false;
+RecordWriter Writer;
+
+/***************************************************************************** 
+ * Write the time between events as Delay lines into a text recording, so it
+ * plays back with the pauses it was made with. A binary recording always has
+ * them.
+ ****************************************************************************/
+bool Timed = false;
+
+/***************************************************************************** 
+ * With -p or -g a run of motion is held back until the next other event and
+ * only the points simplifyPath keeps are written, see flushPath. A run is
+ * cut at PathRun points, so a long drag doesn't pile up.
+ ****************************************************************************/
+double PathTolerance = 0;
+unsigned long PathGap = 0;
+const size_t PathRun = 1024;
+
+/***************************************************************************** 
+ * A binary recording gets a checkpoint every CheckpointInterval ms, so it
+ * can be played from the middle. Checkpoints is written as the index at the
+ * end.
+ ****************************************************************************/
+unsigned int CheckpointInterval = 10000;
+std::vector<RecordIndexEntry> Checkpoints;
+unsigned long long Written = JAYREC_HEADER;
+unsigned long Events = 0;
+Time Started, LastCheckpoint;
+
 /***************************************************************************** 
  * Private data used in eventCallback.
  ****************************************************************************/
@@ -86,6 +121,11 @@ typedef struct
 {
 	int Status1, Status2, x, y, mmoved, doit;
 	unsigned int QuitKey;
+	Time last;		// server time of the last event written
+	unsigned long buttons;		// held down, bit n is button n
+	std::vector<std::string> keys;	// keysym names held down
+	int wx, wy;		// where the motion written last left the pointer
+	std::vector<PathPoint> path;	// motion not written yet
 	Display *LocalDpy, *RecDpy;
 	XRecordContext rc;
 } Priv;
@@ -105,6 +145,14 @@ void usage (const int exitCode) {
   std::cerr << "Options: " << std::endl;
   std::cerr << "  -s  FACTOR  scalefactor for coordinates. Default: 1.0." << std::endl
 	   << "  -k  KEYCODE the keycode for the key used for quitting." << std::endl
+	   << "  -b          write a binary recording instead of text." << std::endl
+	   << "  -t          write the pauses between events into a text recording." << std::endl
+	   << "  -p  PIXELS  leave out the motion that strays at most this far from" << std::endl
+	   << "              the path that is written instead." << std::endl
+	   << "  -g  MS      leave out the motion that comes sooner than this after" << std::endl
+	   << "              the last motion written." << std::endl
+	   << "  -c  SECONDS time between checkpoints of a binary recording." << std::endl
+	   << "              Default: 10." << std::endl
 	   << "  -v          show version. " << std::endl
 	   << "  -h          this help. " << std::endl << std::endl;
 
@@ -183,6 +231,44 @@ void parseCommandLine (int argc, char * argv[]) {
 	  Index++;
 	}
 	
+	// is this '-b'?
+	else if ( strcmp (argv[Index], "-b" ) == 0 ) {
+	  Binary = true;
+	}
+
+	// is this '-t'?
+	else if ( strcmp (argv[Index], "-t" ) == 0 ) {
+	  Timed = true;
+	}
+
+	// is this '-p'?
+	else if ( strcmp (argv[Index], "-p" ) == 0 && Index + 1 < argc ) {
+	  if ( sscanf ( argv[Index + 1], "%lf", &PathTolerance ) != 1 || PathTolerance < 0 ) {
+		std::cerr << "Invalid parameter for '-p'." << std::endl;
+		usage ( EXIT_FAILURE );
+	  }
+	  Index++;
+	}
+
+	// is this '-g'?
+	else if ( strcmp (argv[Index], "-g" ) == 0 && Index + 1 < argc ) {
+	  if ( sscanf ( argv[Index + 1], "%lu", &PathGap ) != 1 ) {
+		std::cerr << "Invalid parameter for '-g'." << std::endl;
+		usage ( EXIT_FAILURE );
+	  }
+	  Index++;
+	}
+
+	// is this '-c'?
+	else if ( strcmp (argv[Index], "-c" ) == 0 && Index + 1 < argc ) {
+	  if ( sscanf ( argv[Index + 1], "%u", &CheckpointInterval ) != 1 || CheckpointInterval == 0 ) {
+		std::cerr << "Invalid parameter for '-c'." << std::endl;
+		usage ( EXIT_FAILURE );
+	  }
+	  CheckpointInterval *= 1000;
+	  Index++;
+	}
+
 	else {
 	  // we got this far, the parameter is no good...
 	  std::cerr << "Invalid parameter '" << argv[Index] << "'." << std::endl;
@@ -310,6 +396,153 @@ int scale (const int Coordinate) {
 #define DBG
 #endif
 
+/****************************************************************************/
+/*! Write one event, as a line of text or as a record. Records are flushed
+    right away too, so the recording can be piped into jayplay.
+*/
+/****************************************************************************/
+void writeRecord (Priv *p, Time tstamp, RecordType type, int x, int y,
+				  unsigned int b, const char * keysym) {
+
+  if ( keysym == NULL ) {
+	keysym = "NoSymbol";
+  }
+
+  // the first event starts the clock
+  unsigned long time = p->last == CurrentTime ? 0 : (unsigned int)(tstamp - p->last);
+  if ( p->last == CurrentTime ) {
+	Started = tstamp;
+  }
+  p->last = tstamp;
+
+  if ( ! Binary ) {
+	if ( Timed && time > 0 ) {
+	  std::cout << "Delay " << time << "ms" << std::endl;
+	}
+	switch ( type ) {
+	  case REC_MOTION:        std::cout << "MotionNotify " << x << " " << y << std::endl; break;
+	  case REC_BUTTONPRESS:   std::cout << "ButtonPress " << b << std::endl; break;
+	  case REC_BUTTONRELEASE: std::cout << "ButtonRelease " << b << std::endl; break;
+	  case REC_KEYPRESS:      std::cout << "KeyStrPress " << keysym << std::endl; break;
+	  case REC_KEYRELEASE:    std::cout << "KeyStrRelease " << keysym << std::endl; break;
+	  default: break;
+	}
+	return;
+  }
+
+  static std::string data;
+  data.clear();
+
+  // is it time for a checkpoint? It goes before the event, with the state
+  // from before it
+  if ( Checkpoints.empty() || (unsigned int)(tstamp - LastCheckpoint) >= CheckpointInterval ) {
+	RecordCheckpoint cp;
+	cp.number = Checkpoints.size();
+	cp.events = Events;
+	cp.time = (unsigned int)(tstamp - Started);
+	cp.x = p->wx == -1 ? p->x : p->wx;
+	cp.y = p->wx == -1 ? p->y : p->wy;
+	cp.status1 = p->Status1;
+	cp.status2 = p->Status2;
+	cp.buttons = p->buttons;
+	cp.keys = p->keys;
+	RecordIndexEntry entry = { cp.number, cp.time, Written };
+	Checkpoints.push_back ( entry );
+	Writer.Checkpoint ( data, time, cp );
+	LastCheckpoint = tstamp;
+	time = 0;
+  }
+
+  switch ( type ) {
+	case REC_MOTION:        Writer.Motion ( data, time, x, y ); break;
+	case REC_BUTTONPRESS:   Writer.Button ( data, time, true, b ); break;
+	case REC_BUTTONRELEASE: Writer.Button ( data, time, false, b ); break;
+	case REC_KEYPRESS:      Writer.Key ( data, time, true, keysym ); break;
+	case REC_KEYRELEASE:    Writer.Key ( data, time, false, keysym ); break;
+	default: break;
+  }
+  std::cout.write ( data.data(), data.size() );
+  std::cout.flush();
+  Written += data.size();
+  Events++;
+
+  // keep track of what is held down for the next checkpoint
+  std::vector<std::string>::iterator key = std::find ( p->keys.begin(), p->keys.end(), keysym );
+  switch ( type ) {
+	case REC_BUTTONPRESS:
+	  if ( b < sizeof(p->buttons) * 8 ) p->buttons |= 1UL << b;
+	  break;
+	case REC_BUTTONRELEASE:
+	  if ( b < sizeof(p->buttons) * 8 ) p->buttons &= ~(1UL << b);
+	  break;
+	case REC_KEYPRESS:
+	  if ( key == p->keys.end() ) p->keys.push_back ( keysym );
+	  break;
+	case REC_KEYRELEASE:
+	  if ( key != p->keys.end() ) p->keys.erase ( key );
+	  break;
+	case REC_MOTION:
+	  p->wx = x;
+	  p->wy = y;
+	  break;
+	default:
+	  break;
+  }
+}
+
+
+/****************************************************************************/
+/*! Write the motion held back with -p or -g, simplified. The run starts
+    where the motion written before it left the pointer.
+*/
+/****************************************************************************/
+void flushPath (Priv *p) {
+
+  std::vector<PathPoint> path;
+  std::vector<bool> keep;
+
+  if ( p->path.empty() ) {
+	return;
+  }
+  if ( p->wx != -1 ) {
+	PathPoint from = { p->wx, p->wy, p->last };
+	path.push_back ( from );
+  }
+  path.insert ( path.end(), p->path.begin(), p->path.end() );
+  p->path.clear();
+
+  simplifyPath ( path, PathTolerance, PathGap, keep );
+  for ( size_t i = p->wx != -1 ? 1 : 0; i < path.size(); i++ ) {
+	if ( keep[i] ) {
+	  writeRecord ( p, path[i].time, REC_MOTION, path[i].x, path[i].y, 0, NULL );
+	}
+  }
+}
+
+
+/****************************************************************************/
+/*! Write one event, motion goes through flushPath with -p or -g.
+*/
+/****************************************************************************/
+void writeEvent (Priv *p, Time tstamp, RecordType type, int x, int y,
+				 unsigned int b, const char * keysym) {
+
+  if ( PathTolerance > 0 || PathGap > 0 ) {
+	if ( type == REC_MOTION ) {
+	  PathPoint point = { x, y, tstamp };
+	  p->path.push_back ( point );
+	  if ( p->path.size() < PathRun ) {
+		return;
+	  }
+	}
+	flushPath ( p );
+	if ( type == REC_MOTION ) {
+	  return;
+	}
+  }
+  writeRecord ( p, tstamp, type, x, y, b, keysym );
+}
+
 void eventCallback(XPointer priv, XRecordInterceptData *d)
 {
   Priv *p=(Priv *) priv;
@@ -367,12 +600,12 @@ void eventCallback(XPointer priv, XRecordInterceptData *d)
 		DBG;
 	  if (p->mmoved)
 	  {
-		std::cout << "MotionNotify " << p->x << " " << p->y << std::endl;
+		writeEvent(p, tstamp, REC_MOTION, p->x, p->y, 0, NULL);
 		p->mmoved=0;
 	  }
 	  if (p->Status2<0) p->Status2=0;
 	  p->Status2++;
-	  std::cout << "ButtonPress " << detail << std::endl;
+	  writeEvent(p, tstamp, REC_BUTTONPRESS, 0, 0, detail, NULL);
       break;
 
     case ButtonRelease:
@@ -380,12 +613,12 @@ void eventCallback(XPointer priv, XRecordInterceptData *d)
 		DBG;
 	  if (p->mmoved)
 	  {
-		std::cout << "MotionNotify " << p->x << " " << p->y << std::endl;
+		writeEvent(p, tstamp, REC_MOTION, p->x, p->y, 0, NULL);
 		p->mmoved=0;
 	  }
 	  p->Status2--;
 	  if (p->Status2<0) p->Status2=0;
-	  std::cout << "ButtonRelease " << detail << std::endl;
+	  writeEvent(p, tstamp, REC_BUTTONRELEASE, 0, 0, detail, NULL);
 	  break;
 
 	case MotionNotify:
@@ -393,7 +626,7 @@ void eventCallback(XPointer priv, XRecordInterceptData *d)
 		DBG;
 	  if (p->Status2>0)
 	  {
-	  	std::cout << "MotionNotify " << rootx << " " << rooty << std::endl;
+	  	writeEvent(p, tstamp, REC_MOTION, rootx, rooty, 0, NULL);
 	  	p->mmoved=0;
 	  }
 	  else p->mmoved=1;
@@ -414,10 +647,10 @@ void eventCallback(XPointer priv, XRecordInterceptData *d)
 		// send the keycode to the remote server
 		if (p->mmoved)
 		{
-			std::cout << "MotionNotify " << p->x << " " << p->y << std::endl;
+			writeEvent(p, tstamp, REC_MOTION, p->x, p->y, 0, NULL);
 			p->mmoved=0;
 		}
-		std::cout << "KeyStrPress " << XKeysymToString(XKeycodeToKeysym(p->LocalDpy,detail,0)) << std::endl;
+		writeEvent(p, tstamp, REC_KEYPRESS, 0, 0, 0, XKeysymToString(XKeycodeToKeysym(p->LocalDpy,detail,0)));
 	  }
 	  break;
 
@@ -426,10 +659,10 @@ void eventCallback(XPointer priv, XRecordInterceptData *d)
 		DBG;
 	  if (p->mmoved)
 	  {
-		std::cout << "MotionNotify " << p->x << " " << p->y << std::endl;
+		writeEvent(p, tstamp, REC_MOTION, p->x, p->y, 0, NULL);
 		p->mmoved=0;
 	  }
-	  std::cout << "KeyStrRelease " << XKeysymToString(XKeycodeToKeysym(p->LocalDpy,detail,0)) << std::endl;
+	  writeEvent(p, tstamp, REC_KEYRELEASE, 0, 0, 0, XKeysymToString(XKeycodeToKeysym(p->LocalDpy,detail,0)));
 	  break;
   }
 returning:
@@ -486,6 +719,9 @@ void eventLoop (Display * LocalDpy, int LocalScreen,
   priv.Status2=0;
   priv.Status1=2;
   priv.doit=1;
+  priv.last=CurrentTime;
+  priv.buttons=0;
+  priv.wx=priv.wy=-1;
   priv.QuitKey=QuitKey;
   priv.LocalDpy=LocalDpy;
   priv.RecDpy=RecDpy;
@@ -498,6 +734,7 @@ void eventLoop (Display * LocalDpy, int LocalScreen,
   }
 
   while (priv.doit) XRecordProcessReplies(RecDpy);
+  flushPath(&priv);
 
   sret=XRecordDisableContext(LocalDpy, rc);
   if (!sret) std::cerr << "XRecordDisableContext failed!" << std::endl;
@@ -556,9 +793,29 @@ int main (int argc, char * argv[]) {
 	std::cerr << "The used quit-key has the keycode: " << QuitKey << std::endl;
   }
   
+  if ( Binary ) {
+	std::string header;
+	Writer.Header ( header );
+	std::cout.write ( header.data(), header.size() );
+	std::cout.flush();
+  } else if ( Timed ) {
+	// the pauses are all the pacing there is, jayplay adds none
+	std::cout << "SetMouseDelay 0" << std::endl
+			  << "SetKeyPressDelay 0" << std::endl
+			  << "SetDelay 0" << std::endl;
+  }
+
   // start the main event loop
   eventLoop ( LocalDpy, LocalScreen, RecDpy, QuitKey );
 
+  // the index of the checkpoints goes last
+  if ( Binary ) {
+	std::string footer;
+	Writer.Index ( footer, Checkpoints, Written );
+	std::cout.write ( footer.data(), footer.size() );
+	std::cout.flush();
+  }
+
   // we're done with the display
 //  XCloseDisplay ( RecDpy );
   XCloseDisplay ( LocalDpy );
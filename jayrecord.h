@@ -0,0 +1,540 @@
+/*****************************************************************************
+ *
+ * jayrecord.h is the binary recording format of jayrec, jayplay and jayconv
+ *
+ * A recording starts with an 8 byte header: "JAYREC", the version and a
+ * byte that is 0 for now. After that come the records, each one starts with
+ * a tag byte. The low 3 bits of the tag are the type, the high 5 bits the
+ * time since the previous record in milliseconds. When the time doesn't fit
+ * in 5 bits they are all set and the time follows as a varint.
+ *
+ *   Keysym         id, length, name   a name the key records refer to
+ *   Motion         dx, dy             from the previous Motion, 0 0 at first
+ *   ButtonPress    button
+ *   ButtonRelease  button
+ *   KeyPress       keysym id
+ *   KeyRelease     keysym id
+ *   Text           length, text       any other line of a script
+ *   Checkpoint     0, number, events, time, x, y, Status1, Status2,
+ *                  buttons, key count, (length, name) for each held key
+ *   Index          1, count, (number, offset, time) for each checkpoint,
+ *                  the offset of the index as 8 bytes and "JAYINDEX"
+ *
+ * Numbers are varints, 7 bits to a byte with the low bits first, dx and dy
+ * are zigzag encoded so small negative steps stay small. A Keysym record is
+ * written right before the first key record that uses it, so a recording
+ * can be played while it is still being written.
+ *
+ * Playback can start at a Checkpoint: it has the pointer position and the
+ * buttons and keys held down, and the keysym dictionary starts over after
+ * it. The Index comes last, when the recording was finished properly, and
+ * is found from the end of the file. Its numbers are deltas from the entry
+ * before. Without it the checkpoints can still be found by reading through.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ ****************************************************************************/
+#ifndef JAYRECORD_H
+#define JAYRECORD_H
+
+#include <string.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#define JAYREC_MAGIC   "JAYREC"
+#define JAYREC_VERSION 1
+#define JAYREC_HEADER  8
+#define JAYREC_TIME    31   // time bits of a tag when the time follows
+
+enum RecordType {
+  REC_KEYSYM,
+  REC_MOTION,
+  REC_BUTTONPRESS,
+  REC_BUTTONRELEASE,
+  REC_KEYPRESS,
+  REC_KEYRELEASE,
+  REC_TEXT,
+  REC_CHECKPOINT        // the Index is a checkpoint record too
+};
+#define JAYREC_INDEX   "JAYINDEX"
+#define JAYREC_TRAILER 16   // offset of the index and JAYREC_INDEX
+
+struct RecordCheckpoint {
+  unsigned long number;
+  unsigned long events; // events written before it
+  unsigned long time;   // ms since the recording started
+  int x, y;
+  int status1, status2; // as jayrec's Priv had them
+  unsigned long buttons;           // bit n is button n
+  std::vector<std::string> keys;   // keysym names held down
+};
+struct RecordIndexEntry {
+  unsigned long number;
+  unsigned long time;
+  unsigned long long offset;
+};
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * One record as it is read back. Keysym records are taken care of by the
+ * reader, text and name point into the data or the dictionary.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+struct RecordEvent {
+  RecordType type;
+  unsigned long time;   // ms since the previous event
+  int x, y;             // Motion, absolute
+  unsigned int b;       // ButtonPress, ButtonRelease
+  const char * text;    // Text, or the keysym name of a key
+  size_t length;
+  RecordCheckpoint checkpoint;
+};
+
+static inline bool isRecording(const char * data, size_t size) {
+  return size >= JAYREC_HEADER && !memcmp(data, JAYREC_MAGIC, 6);
+}
+
+static inline void putVarint(std::string &out, unsigned long v) {
+  while (v >= 0x80) {
+    out += (char)(v | 0x80);
+    v >>= 7;
+  }
+  out += (char)v;
+}
+// false when the number runs past end, p is only moved on success
+static inline bool getVarint(const char *&p, const char * end, unsigned long &v) {
+  const char * q = p;
+  int shift = 0;
+  v = 0;
+  while (q < end && shift < 64) {
+    unsigned char c = *q++;
+    v |= (unsigned long)(c & 0x7F) << shift;
+    if (!(c & 0x80)) {
+      p = q;
+      return true;
+    }
+    shift += 7;
+  }
+  return false;
+}
+static inline bool getString(const char *&p, const char * end, std::string &s) {
+  unsigned long n;
+  const char * q = p;
+  if (!getVarint(q, end, n) || (unsigned long)(end - q) < n) {
+    return false;
+  }
+  s.assign(q, n);
+  p = q + n;
+  return true;
+}
+static inline unsigned long zigzag(long v) {
+  return ((unsigned long)v << 1) ^ (unsigned long)(v >> (sizeof(long) * 8 - 1));
+}
+static inline long unzigzag(unsigned long v) {
+  return (long)(v >> 1) ^ -(long)(v & 1);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Appends records to a string, the caller writes it out whenever it likes.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+class RecordWriter {
+  public:
+    RecordWriter() : p_x(0), p_y(0) {}
+    void Header(std::string &out) {
+      out.append(JAYREC_MAGIC, 6);
+      out += (char)JAYREC_VERSION;
+      out += (char)0;
+    }
+    void Motion(std::string &out, unsigned long time, int x, int y) {
+      tag(out, REC_MOTION, time);
+      putVarint(out, zigzag(x - p_x));
+      putVarint(out, zigzag(y - p_y));
+      p_x = x;
+      p_y = y;
+    }
+    void Button(std::string &out, unsigned long time, bool press, unsigned int b) {
+      tag(out, press ? REC_BUTTONPRESS : REC_BUTTONRELEASE, time);
+      putVarint(out, b);
+    }
+    void Key(std::string &out, unsigned long time, bool press, const std::string &name) {
+      std::map<std::string,int>::iterator it = p_keysyms.find(name);
+      if (it == p_keysyms.end()) {
+        int id = p_keysyms.size();
+        it = p_keysyms.insert(std::make_pair(name, id)).first;
+        tag(out, REC_KEYSYM, 0);
+        putVarint(out, id);
+        putVarint(out, name.size());
+        out += name;
+      }
+      tag(out, press ? REC_KEYPRESS : REC_KEYRELEASE, time);
+      putVarint(out, it->second);
+    }
+    void Text(std::string &out, unsigned long time, const std::string &text) {
+      tag(out, REC_TEXT, time);
+      putVarint(out, text.size());
+      out += text;
+    }
+    void Checkpoint(std::string &out, unsigned long time, const RecordCheckpoint &cp) {
+      tag(out, REC_CHECKPOINT, time);
+      putVarint(out, 0);
+      putVarint(out, cp.number);
+      putVarint(out, cp.events);
+      putVarint(out, cp.time);
+      putVarint(out, zigzag(cp.x));
+      putVarint(out, zigzag(cp.y));
+      putVarint(out, zigzag(cp.status1));
+      putVarint(out, zigzag(cp.status2));
+      putVarint(out, cp.buttons);
+      putVarint(out, cp.keys.size());
+      for (size_t i = 0; i < cp.keys.size(); i++) {
+        putVarint(out, cp.keys[i].size());
+        out += cp.keys[i];
+      }
+      // what follows doesn't depend on anything before
+      p_x = cp.x;
+      p_y = cp.y;
+      p_keysyms.clear();
+    }
+    // at is where in the file the index starts
+    void Index(std::string &out, const std::vector<RecordIndexEntry> &index, unsigned long long at) {
+      tag(out, REC_CHECKPOINT, 0);
+      putVarint(out, 1);
+      putVarint(out, index.size());
+      RecordIndexEntry last = { 0, 0, 0 };
+      for (size_t i = 0; i < index.size(); i++) {
+        putVarint(out, index[i].number - last.number);
+        putVarint(out, index[i].offset - last.offset);
+        putVarint(out, index[i].time - last.time);
+        last = index[i];
+      }
+      for (int i = 0; i < 8; i++) {
+        out += (char)(at >> (i * 8));
+      }
+      out.append(JAYREC_INDEX, 8);
+    }
+  private:
+    void tag(std::string &out, RecordType type, unsigned long time) {
+      if (time < JAYREC_TIME) {
+        out += (char)(type | (time << 3));
+      } else {
+        out += (char)(type | (JAYREC_TIME << 3));
+        putVarint(out, time);
+      }
+    }
+    int p_x, p_y;
+    std::map<std::string,int> p_keysyms;
+};
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Reads records back. Next returns 1 with the next event, 0 when the data
+ * ends in the middle of a record (p stays at its start, so it can be tried
+ * again with more data) and -1 when the data makes no sense.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+class RecordReader {
+  public:
+    RecordReader() : p_x(0), p_y(0) {}
+    int Next(const char *&p, const char * end, RecordEvent &ev) {
+      unsigned long time = 0;
+      for (;;) {
+        const char * q = p;
+        unsigned long t, a, b;
+        if (q >= end) {
+          return 0;
+        }
+        unsigned char tag = *q++;
+        t = tag >> 3;
+        if (t == JAYREC_TIME && !getVarint(q, end, t)) {
+          return 0;
+        }
+        ev.type = (RecordType)(tag & 7);
+        switch (ev.type) {
+          case REC_KEYSYM:
+            if (!getVarint(q, end, a) || !getVarint(q, end, b)) {
+              return 0;
+            }
+            if (a > p_keysyms.size()) {
+              return -1;
+            }
+            if ((unsigned long)(end - q) < b) {
+              return 0;
+            }
+            if (a == p_keysyms.size()) {
+              p_keysyms.push_back(std::string(q, b));
+            } else {
+              p_keysyms[a].assign(q, b);
+            }
+            q += b;
+            p = q;
+            time += t;
+            continue;
+          case REC_MOTION:
+            if (!getVarint(q, end, a) || !getVarint(q, end, b)) {
+              return 0;
+            }
+            p_x += unzigzag(a);
+            p_y += unzigzag(b);
+            ev.x = p_x;
+            ev.y = p_y;
+            break;
+          case REC_BUTTONPRESS:
+          case REC_BUTTONRELEASE:
+            if (!getVarint(q, end, a)) {
+              return 0;
+            }
+            ev.b = a;
+            break;
+          case REC_KEYPRESS:
+          case REC_KEYRELEASE:
+            if (!getVarint(q, end, a)) {
+              return 0;
+            }
+            if (a >= p_keysyms.size()) {
+              return -1;
+            }
+            ev.text = p_keysyms[a].c_str();
+            ev.length = p_keysyms[a].size();
+            break;
+          case REC_TEXT:
+            if (!getVarint(q, end, a)) {
+              return 0;
+            }
+            if ((unsigned long)(end - q) < a) {
+              return 0;
+            }
+            ev.text = q;
+            ev.length = a;
+            q += a;
+            break;
+          case REC_CHECKPOINT:
+            if (!getVarint(q, end, a)) {
+              return 0;
+            }
+            if (a == 1) {
+              // the index, nothing to play
+              std::vector<RecordIndexEntry> index;
+              int r = readIndex(q, end, index);
+              if (r <= 0) {
+                return r;
+              }
+              p = q;
+              time += t;
+              continue;
+            }
+            if (a != 0) {
+              return -1;
+            }
+            {
+              RecordCheckpoint &cp = ev.checkpoint;
+              unsigned long v[8];
+              for (int i = 0; i < 8; i++) {
+                if (!getVarint(q, end, v[i])) {
+                  return 0;
+                }
+              }
+              cp.number = v[0];
+              cp.events = v[1];
+              cp.time = v[2];
+              cp.x = unzigzag(v[3]);
+              cp.y = unzigzag(v[4]);
+              cp.status1 = unzigzag(v[5]);
+              cp.status2 = unzigzag(v[6]);
+              cp.buttons = v[7];
+              if (!getVarint(q, end, a)) {
+                return 0;
+              }
+              cp.keys.resize(a);
+              for (unsigned long i = 0; i < a; i++) {
+                if (!getString(q, end, cp.keys[i])) {
+                  return 0;
+                }
+              }
+              p_x = cp.x;
+              p_y = cp.y;
+              p_keysyms.clear();
+            }
+            break;
+          default:
+            return -1;
+        }
+        ev.time = time + t;
+        p = q;
+        return 1;
+      }
+    }
+    // where the pointer is, for starting over in the middle of a recording
+    void Position(int &x, int &y) const {
+      x = p_x;
+      y = p_y;
+    }
+    void SetPosition(int x, int y) {
+      p_x = x;
+      p_y = y;
+    }
+    /* Reads the index entries that follow the kind of an Index record, p is
+       moved past the trailer. Same results as Next. */
+    static int readIndex(const char *&p, const char * end, std::vector<RecordIndexEntry> &index) {
+      const char * q = p;
+      unsigned long count, a, b, c;
+      RecordIndexEntry e = { 0, 0, 0 };
+      if (!getVarint(q, end, count)) {
+        return 0;
+      }
+      for (unsigned long i = 0; i < count; i++) {
+        if (!getVarint(q, end, a) || !getVarint(q, end, b) || !getVarint(q, end, c)) {
+          return 0;
+        }
+        e.number += a;
+        e.offset += b;
+        e.time += c;
+        index.push_back(e);
+      }
+      if (end - q < JAYREC_TRAILER) {
+        return 0;
+      }
+      if (memcmp(q + 8, JAYREC_INDEX, 8)) {
+        return -1;
+      }
+      p = q + JAYREC_TRAILER;
+      return 1;
+    }
+  private:
+    int p_x, p_y;
+    std::vector<std::string> p_keysyms;
+};
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * The index of a finished recording. tail holds the file from offset base
+ * to its end, which has to take in the whole index. When tail is too short
+ * at is set to where the index starts, so the caller can read from there.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+static inline bool findIndex(const char * tail, size_t size, unsigned long long base,
+                             std::vector<RecordIndexEntry> &index, unsigned long long &at) {
+  const char * end = tail + size;
+  unsigned long kind;
+  at = 0;
+  if (size < JAYREC_TRAILER || memcmp(end - 8, JAYREC_INDEX, 8)) {
+    return false;
+  }
+  for (int i = 0; i < 8; i++) {
+    at |= (unsigned long long)(unsigned char)end[-JAYREC_TRAILER + i] << (i * 8);
+  }
+  if (at < base || at >= base + size) {
+    return false;
+  }
+  const char * p = tail + (at - base);
+  if ((*p & 7) != REC_CHECKPOINT || (((unsigned char)*p) >> 3) != 0) {
+    return false;
+  }
+  p++;
+  if (!getVarint(p, end, kind) || kind != 1) {
+    return false;
+  }
+  index.clear();
+  return RecordReader::readIndex(p, end, index) > 0 && p == end;
+}
+
+// the checkpoints of a recording without an index, by reading all of it
+static inline void scanCheckpoints(const char * data, size_t size,
+                                   std::vector<RecordIndexEntry> &index) {
+  RecordReader reader;
+  RecordEvent ev;
+  const char * p = data + JAYREC_HEADER;
+  const char * end = data + size;
+  const char * start = p;
+  index.clear();
+  while (reader.Next(p, end, ev) > 0) {
+    if (ev.type == REC_CHECKPOINT) {
+      RecordIndexEntry entry = { ev.checkpoint.number, ev.checkpoint.time,
+                                 (unsigned long long)(start - data) };
+      index.push_back(entry);
+    }
+    start = p;
+  }
+}
+
+// the last entry at or before checkpoint number, or time when bytime
+static inline int findCheckpoint(const std::vector<RecordIndexEntry> &index,
+                                 bool bytime, unsigned long value) {
+  int found = -1;
+  for (size_t i = 0; i < index.size(); i++) {
+    if ((bytime ? index[i].time : index[i].number) <= value) {
+      found = i;
+    }
+  }
+  return found;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * A run of motion between two other events is simplified with
+ * Ramer-Douglas-Peucker: the point farthest from the line between the ends
+ * stays when it is more than tolerance pixels off it, and the two halves are
+ * looked at the same way. Of what is left, a point less than gap ms after
+ * the one kept before it goes too. The first and the last point always stay,
+ * so a press after the run lands where it did.
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+struct PathPoint {
+  int x, y;
+  unsigned long time;   // ms, from whenever the caller likes
+};
+
+// squared distance of p from the segment a b
+static inline double pathDistance(const PathPoint &p, const PathPoint &a, const PathPoint &b) {
+  double dx = b.x - a.x, dy = b.y - a.y;
+  double px = p.x - a.x, py = p.y - a.y;
+  double length = dx * dx + dy * dy;
+  if (length > 0) {
+    double t = (px * dx + py * dy) / length;
+    t = t < 0 ? 0 : (t > 1 ? 1 : t);
+    px -= t * dx;
+    py -= t * dy;
+  }
+  return px * px + py * py;
+}
+
+// keep[i] is set for the points of path that stay
+static inline void simplifyPath(const std::vector<PathPoint> &path, double tolerance,
+                                unsigned long gap, std::vector<bool> &keep) {
+  size_t n = path.size();
+  keep.assign(n, tolerance <= 0);
+  if (n < 3) {
+    keep.assign(n, true);
+    return;
+  }
+  keep[0] = keep[n - 1] = true;
+  if (tolerance > 0) {
+    // the halves still to look at, a stack instead of recursion
+    std::vector<std::pair<size_t,size_t> > spans;
+    spans.push_back(std::make_pair((size_t)0, n - 1));
+    while (!spans.empty()) {
+      size_t first = spans.back().first, last = spans.back().second;
+      spans.pop_back();
+      size_t far = 0;
+      double farthest = tolerance * tolerance;
+      for (size_t i = first + 1; i < last; i++) {
+        double d = pathDistance(path[i], path[first], path[last]);
+        if (d > farthest) {
+          farthest = d;
+          far = i;
+        }
+      }
+      if (far) {
+        keep[far] = true;
+        spans.push_back(std::make_pair(first, far));
+        spans.push_back(std::make_pair(far, last));
+      }
+    }
+  }
+  if (gap > 0) {
+    unsigned long previous = path[0].time;
+    for (size_t i = 1; i < n - 1; i++) {
+      if (keep[i] && path[i].time - previous < gap) {
+        keep[i] = false;
+      } else if (keep[i]) {
+        previous = path[i].time;
+      }
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,16 @@
+#!/bin/sh
+# Converts test/recorded.rec, a jayrec -t recording, to a binary one and
+# back, which has to give the same text, then plays the binary one from its
+# second checkpoint. Run it from the top directory after make:
+#   test/convert.sh :5
+
+if [ $# -lt 1 ]
+then
+	echo 'Usage: test/convert.sh <display>'
+	exit 1
+fi
+
+bin=/tmp/recorded.jayr
+./jayconv -c 1 test/recorded.rec $bin || exit 1
+./jayconv $bin | diff test/recorded.rec - && echo 'round trip: same'
+./jayplay --start-at 2 $1 $bin